@@ -52,7 +52,7 @@ solution "EVP"
   -- Libraries/Defines
   
   configuration "not macosx"
-    links {"OpenCL"}
+    links {"OpenCL", "pthread"}
   
   configuration {"macosx", "gmake"}
     linkoptions {"-framework OpenCL"}
@@ -109,4 +109,25 @@ solution "EVP"
 
     includedirs {"deps/clip/include", "deps/evp/include"}
 
-    files {"src/evp/evp.cpp"}
\ No newline at end of file
+    files {"src/evp/*.cpp"}
+
+  project "evp-tests"
+    kind "ConsoleApp"
+    language "C++"
+
+    targetname "evp-tests"
+
+    includedirs {"deps/clip/include", "deps/evp/include", "src/evp"}
+
+    files {"src/tests/*.cpp", "src/evp/ingest.cpp", "src/evp/manifest.cpp"}
+    excludes {"src/tests/regress.cpp"}
+
+  project "evp-regress"
+    kind "ConsoleApp"
+    language "C++"
+
+    targetname "evp-regress"
+
+    includedirs {"deps/clip/include", "deps/evp/include"}
+
+    files {"src/tests/regress.cpp"}
@@ -1,11 +1,24 @@
 #include <sstream>
+#include <iomanip>
 #include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <stdexcept>
+
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <evp/io/imageio.hpp> // Include this first for debugging
 #include <evp.hpp>
 #include <evp/io.hpp>
 #include <evp/util/tictoc.hpp>
 
+#include "ingest.hpp"
+#include "manifest.hpp"
+#include "memplan.hpp"
+#include "metrics.hpp"
+
 using namespace std;
 using namespace std::tr1;
 using namespace evp;
@@ -113,6 +126,26 @@ void deviceHandler(int& argc, char**& argv) {
   deviceNum--;
 }
 
+i32 numJobs = 1;
+string numJobsOpts[] = {"-j", "--jobs"};
+string numJobsArgs[] = {"n"};
+string numJobsDesc = "Render PDFs in <n> (=1) processes.";
+void numJobsHandler(int& argc, char**& argv) {
+  getArgument(argc, argv, &numJobs);
+  if (numJobs <= 0)
+    die("Invalid number of jobs (must be > 0)");
+}
+
+i32 numDecodeThreads = 1;
+string numDecodeThreadsOpts[] = {"--decode-threads"};
+string numDecodeThreadsArgs[] = {"n"};
+string numDecodeThreadsDesc = "Decode upcoming images on <n> (=1) threads.";
+void numDecodeThreadsHandler(int& argc, char**& argv) {
+  getArgument(argc, argv, &numDecodeThreads);
+  if (numDecodeThreads < 0)
+    die("Invalid number of decode threads (must be >= 0)");
+}
+
 ValueType valueType = Float32;
 string valueTypeOpts[] = {"-b", "--bit-depth"};
 string valueTypeArgs[] = {"n"};
@@ -163,6 +196,16 @@ void epfHandler(int& argc, char**& argv) {
     die("Invalid number of enqueues per finish (must be > 0)");
 }
 
+f32 memLimit = 0;
+string memLimitOpts[] = {"--mem-limit"};
+string memLimitArgs[] = {"mb"};
+string memLimitDesc = "Skip images estimated to need > <mb> MB on device.";
+void memLimitHandler(int& argc, char**& argv) {
+  getArgument(argc, argv, &memLimit);
+  if (memLimit < 0)
+    die("Invalid memory limit (must be >= 0)");
+}
+
 i32 numOrientations = 8;
 string numOrientationsOpts[] = {"-t", "--orientations"};
 string numOrientationsArgs[] = {"n"};
@@ -343,6 +386,31 @@ void outputDirHandler(int& argc, char**& argv) {
   getArgument(argc, argv, &outputDir);
 }
 
+bool resume = false;
+string resumeOpts[] = {"--resume"};
+string resumeDesc = "Skip inputs whose outputs are already in the manifest.";
+void resumeHandler(int&, char**&) {
+  resume = true;
+}
+
+string metricsFile;
+string metricsFileOpts[] = {"--metrics"};
+string metricsFileArgs[] = {"file"};
+string metricsFileDesc = "Write run metrics to <file> (JSON if *.json).";
+void metricsFileHandler(int& argc, char**& argv) {
+  getArgument(argc, argv, &metricsFile);
+}
+
+f32 metricsInterval = 10;
+string metricsIntervalOpts[] = {"--metrics-interval"};
+string metricsIntervalArgs[] = {"s"};
+string metricsIntervalDesc = "Write metrics every <s> (=10) seconds.";
+void metricsIntervalHandler(int& argc, char**& argv) {
+  getArgument(argc, argv, &metricsInterval);
+  if (metricsInterval <= 0)
+    die("Invalid metrics interval (must be > 0)");
+}
+
 f32 pdfThresh = 0.01f;
 string pdfThreshOpts[] = {"--pdf-thresh"};
 string pdfThreshArgs[] = {"t"};
@@ -386,9 +454,12 @@ OptionEntry options[] = {
   OPTION_COMMAND_ENTRY(help),
   OPTION_ARGS_ENTRY(platform),
   OPTION_ARGS_ENTRY(device),
+  OPTION_ARGS_ENTRY(numJobs),
+  OPTION_ARGS_ENTRY(numDecodeThreads),
   OPTION_ARGS_ENTRY(valueType),
   OPTION_ARGS_ENTRY(bufferType),
   OPTION_ARGS_ENTRY(epf),
+  OPTION_ARGS_ENTRY(memLimit),
   OPTION_ARGS_ENTRY(numOrientations),
   OPTION_ARGS_ENTRY(numCurvatures),
   OPTION_ARGS_ENTRY(curveScale),
@@ -408,7 +479,10 @@ OptionEntry options[] = {
   OPTION_FLAG_ENTRY(pdf),
   OPTION_ARGS_ENTRY(pdfThresh),
   OPTION_ARGS_ENTRY(pdfDarken),
-  OPTION_ARGS_ENTRY(outputDir)
+  OPTION_ARGS_ENTRY(outputDir),
+  OPTION_FLAG_ENTRY(resume),
+  OPTION_ARGS_ENTRY(metricsFile),
+  OPTION_ARGS_ENTRY(metricsInterval)
 };
 i32 numOptions = sizeof(options)/sizeof(OptionEntry);
 
@@ -522,23 +596,568 @@ loopend:
   return commandSpecified;
 }
 
+struct InputPath {
+  string file;
+  string dirName;
+  string name;
+  string baseName;
+  string extension;
+  
+  bool isMatFile() const { return extension == "mat"; }
+};
+
+InputPath parseInputPath(const string& file) {
+  InputPath path;
+  path.file = file;
+  path.dirName = ".";
+  path.name = file;
+  
+  size_t lastSlash = file.find_last_of('/');
+  if (lastSlash != string::npos) {
+    if (lastSlash >= file.length() - 1)
+      die("Input name can't end in a slash");
+    
+    path.dirName = file.substr(0, lastSlash);
+    path.name = file.substr(lastSlash + 1);
+  }
+  
+  size_t lastDot = path.name.find_last_of('.');
+  if (lastDot == string::npos || lastDot >= path.name.length() - 1)
+    die("No filename extension found; unable to determine type");
+  
+  path.baseName = path.name.substr(0, lastDot);
+  path.extension = path.name.substr(lastDot + 1);
+  
+  return path;
+}
+
+Metrics metrics;
+
+/// Fingerprints every option that affects the contents of an output, so that
+/// --resume only skips work done with the current settings. Nine significant
+/// digits are enough to tell any two distinct f32 values apart.
+u64 parametersHash() {
+  stringstream ss;
+  ss << setprecision(9);
+  ss << numOrientations << ' ' << numCurvatures << ' ' << valueType << ' '
+     << bufferType << ' ' << curveScale << ' ' << rlxThresh << ' '
+     << curveIters << ' ' << curveDelta << ' ' << flowInitType << ' '
+     << flowInitSize << ' ' << flowMinConf << ' ' << flowThetaJitters << ' '
+     << flowNumScaleJitters << ' ' << flowInitThresh << ' ' << flowIters
+     << ' ' << flowDelta << ' ' << flowMinSupport << ' ' << outputMatlab
+     << ' ' << outputPdf << ' ' << pdfThresh << ' ' << pdfDarken;
+  return HashString(ss.str());
+}
+
+string manifestPath() {
+  return outputDir + "/evp-manifest.txt";
+}
+
+// Outputs are written under a temporary name and renamed into place, so an
+// interrupted run never leaves a truncated file under the final name.
+
+void writeOutputs(const string& outputName, const CurveData& data) {
+  if (outputMatlab) {
+    string name = outputName + ".mat", partial = PartialOutputName(name);
+    WriteMatlabArray(partial, data);
+    CommitOutput(partial, name);
+    metrics.addBytesWritten(FileSize(name));
+  }
+  
+  if (outputPdf) {
+    string name = outputName + ".pdf", partial = PartialOutputName(name);
+    WriteLLColumnsToPDF(partial, data, pdfThresh, pdfDarken);
+    CommitOutput(partial, name);
+    metrics.addBytesWritten(FileSize(name));
+  }
+}
+
+void writeOutputs(const string& outputName, const FlowData& data) {
+  if (outputMatlab) {
+    string name = outputName + ".mat", partial = PartialOutputName(name);
+    WriteMatlabArray(partial, data);
+    CommitOutput(partial, name);
+    metrics.addBytesWritten(FileSize(name));
+  }
+  
+  if (outputPdf) {
+    string name = outputName + ".pdf", partial = PartialOutputName(name);
+    WriteFlowToPDF(partial, data, pdfThresh, pdfDarken);
+    CommitOutput(partial, name);
+    metrics.addBytesWritten(FileSize(name));
+  }
+}
+
+bool deviceCommandsRequested() {
+  return runEdgeInit || runEdgeRelax || runLineInit || runLineRelax ||
+         runEdgeSuppress || runFlowInit || runFlowRelax;
+}
+
+/// The names of the outputs processImages will write for an input, in the
+/// order they are written.
+vector<string> outputStages(bool isMatFile) {
+  vector<string> stages;
+  if (runEdgeInit || (runEdgeRelax && !isMatFile))
+    stages.push_back("edge-initial");
+  if (runEdgeRelax)
+    stages.push_back("edge-relaxed");
+  if (runLineInit || (runLineRelax && !isMatFile))
+    stages.push_back("line-initial");
+  if (runLineRelax)
+    stages.push_back("line-relaxed");
+  if (runEdgeSuppress)
+    stages.push_back("edge-suppressed");
+  if (runFlowInit || (runFlowRelax && !isMatFile))
+    stages.push_back("flow-initial");
+  if (runFlowRelax)
+    stages.push_back("flow-relaxed");
+  return stages;
+}
+
+/// The outcome of rendering one input to PDF.
+struct PdfResult {
+  bool ok;
+  u64 bytesRead;
+  u64 bytesWritten;
+  string message; // What to log on success, the error otherwise
+};
+
+struct PdfBatch {
+  vector<InputPath> inputs;
+  vector<i32> pending; // Indices of the inputs that need rendering
+  size_t next;
+  i32 soFar;
+  Manifest* manifest;
+  u64 paramsHash;
+  string stage;
+  vector<string> errors;
+};
+
+/// A forked process rendering PDFs. It reads input indices from taskFd and
+/// writes a PdfResult back to resultFd for each, exiting once taskFd closes.
+struct PdfWorker {
+  pid_t pid;
+  int taskFd;
+  int resultFd;
+  i32 current; // The input being rendered, or -1 when idle
+  string buffer;
+};
+
+PdfResult renderPdf(const InputPath& input) {
+  string outputName = outputDir + "/" + input.baseName + ".pdf";
+  string partialName = PartialOutputName(outputName);
+  
+  PdfResult result;
+  result.ok = false;
+  result.bytesRead = FileSize(input.file);
+  result.bytesWritten = 0;
+  
+  try {
+    if (curvePdf) {
+      CurveDataPtr curveData = ReadMatlabArray<2>(input.file);
+      if (!curveData.get())
+        throw runtime_error("Failed to read curve data from " + input.file);
+      WriteLLColumnsToPDF(partialName, *curveData, pdfThresh, pdfDarken);
+    }
+    else {
+      FlowDataPtr flowData = ReadMatlabArray<3>(input.file);
+      if (!flowData.get())
+        throw runtime_error("Failed to read flow data from " + input.file);
+      WriteFlowToPDF(partialName, *flowData, pdfThresh, pdfDarken);
+    }
+    
+    CommitOutput(partialName, outputName);
+  }
+  catch (const exception& err) {
+    result.message = err.what();
+    return result;
+  }
+  
+  result.ok = true;
+  result.bytesWritten = FileSize(outputName);
+  
+  stringstream log;
+  log << "Wrote " << (curvePdf ? "curve" : "flow") << " data to "
+      << outputName << "." << endl;
+  result.message = log.str();
+  return result;
+}
+
+/// Logs a rendered input and records it in the manifest and metrics. Only
+/// the parent process calls this, so neither is shared with the workers.
+void reportPdf(PdfBatch& batch, i32 index, const PdfResult& result) {
+  const InputPath& input = batch.inputs[index];
+  cout << "Input " << ++batch.soFar << "/" << batch.inputs.size() << ": "
+       << input.baseName << endl;
+  
+  if (!result.ok) {
+    cerr << "Failed: " << result.message << endl;
+    batch.errors.push_back(result.message);
+    return;
+  }
+  
+  cout << result.message << flush;
+  batch.manifest->record(input.file, batch.stage, batch.paramsHash);
+  metrics.addBytesRead(result.bytesRead);
+  metrics.addBytesWritten(result.bytesWritten);
+  metrics.endImage();
+}
+
+string encodePdfResult(i32 index, const PdfResult& result) {
+  stringstream ss;
+  ss << index << ' ' << result.ok << ' ' << result.bytesRead << ' '
+     << result.bytesWritten << ' ' << result.message.size() << '\n'
+     << result.message;
+  return ss.str();
+}
+
+/// Takes one result off the front of buffer, returning false if buffer
+/// doesn't hold a complete one yet.
+bool decodePdfResult(string& buffer, i32& index, PdfResult& result) {
+  size_t newline = buffer.find('\n');
+  if (newline == string::npos)
+    return false;
+  
+  size_t length;
+  stringstream ss(buffer.substr(0, newline));
+  ss >> index >> result.ok >> result.bytesRead >> result.bytesWritten
+     >> length;
+  if (buffer.size() < newline + 1 + length)
+    return false;
+  
+  result.message = buffer.substr(newline + 1, length);
+  buffer.erase(0, newline + 1 + length);
+  return true;
+}
+
+bool writeAll(int fd, const void* data, size_t size) {
+  const char* bytes = static_cast<const char*>(data);
+  while (size) {
+    ssize_t n = write(fd, bytes, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    bytes += n;
+    size -= size_t(n);
+  }
+  return true;
+}
+
+bool readAll(int fd, void* data, size_t size) {
+  char* bytes = static_cast<char*>(data);
+  while (size) {
+    ssize_t n = read(fd, bytes, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    bytes += n;
+    size -= size_t(n);
+  }
+  return true;
+}
+
+void runPdfWorker(const PdfBatch& batch, int taskFd, int resultFd) {
+  i32 index;
+  while (readAll(taskFd, &index, sizeof(index))) {
+    string record = encodePdfResult(index, renderPdf(batch.inputs[index]));
+    if (!writeAll(resultFd, record.data(), record.size()))
+      break;
+  }
+  
+  // Skip the parent's atexit handlers and static destructors, which would
+  // try to join the parent's threads.
+  _exit(0);
+}
+
+bool startPdfWorker(const PdfBatch& batch, vector<PdfWorker>& workers) {
+  int task[2], result[2];
+  if (pipe(task) != 0)
+    return false;
+  if (pipe(result) != 0) {
+    close(task[0]);
+    close(task[1]);
+    return false;
+  }
+  
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(task[0]);
+    close(task[1]);
+    close(result[0]);
+    close(result[1]);
+    return false;
+  }
+  
+  if (pid == 0) {
+    // Only the parent may hold the other workers' pipes, or they would never
+    // see their task pipe close.
+    for (size_t i = 0; i < workers.size(); ++i) {
+      close(workers[i].taskFd);
+      close(workers[i].resultFd);
+    }
+    close(task[1]);
+    close(result[0]);
+    runPdfWorker(batch, task[0], result[1]);
+  }
+  
+  close(task[0]);
+  close(result[1]);
+  
+  PdfWorker worker;
+  worker.pid = pid;
+  worker.taskFd = task[1];
+  worker.resultFd = result[0];
+  worker.current = -1;
+  workers.push_back(worker);
+  return true;
+}
+
+/// Hands the worker the next pending input, or closes its task pipe when
+/// there is none left or an input has failed.
+void sendPdfTask(PdfBatch& batch, PdfWorker& worker) {
+  if (worker.taskFd < 0)
+    return;
+  
+  if (!batch.errors.empty() || batch.next >= batch.pending.size()) {
+    close(worker.taskFd);
+    worker.taskFd = -1;
+    return;
+  }
+  
+  i32 index = batch.pending[batch.next++];
+  metrics.setGauge("pdf_queue_depth", batch.pending.size() - batch.next);
+  
+  if (writeAll(worker.taskFd, &index, sizeof(index))) {
+    worker.current = index;
+  }
+  else {
+    close(worker.taskFd);
+    worker.taskFd = -1;
+    
+    PdfResult failed = PdfResult();
+    failed.message = "Unable to pass " + batch.inputs[index].file +
+                     " to a worker process";
+    reportPdf(batch, index, failed);
+  }
+}
+
+void renderPdfsSerially(PdfBatch& batch) {
+  while (batch.errors.empty() && batch.next < batch.pending.size()) {
+    i32 index = batch.pending[batch.next++];
+    metrics.setGauge("pdf_queue_depth", batch.pending.size() - batch.next);
+    reportPdf(batch, index, renderPdf(batch.inputs[index]));
+  }
+}
+
+/// Renders the pending inputs on up to numWorkers forked processes. Separate
+/// processes sidestep the question of whether the evp PDF writers are thread
+/// safe, and forking is safe here because no OpenCL context exists yet.
+void renderPdfsInWorkers(PdfBatch& batch, i32 numWorkers) {
+  cout.flush();
+  cerr.flush();
+  
+  vector<PdfWorker> workers;
+  for (i32 i = 0; i < numWorkers; ++i) {
+    if (!startPdfWorker(batch, workers))
+      break;
+  }
+  
+  if (workers.empty()) {
+    renderPdfsSerially(batch);
+    return;
+  }
+  
+  // A worker that dies shows up as end of file on its result pipe; writing
+  // to its task pipe mustn't kill the parent first.
+  void (*oldSigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+  
+  for (size_t i = 0; i < workers.size(); ++i)
+    sendPdfTask(batch, workers[i]);
+  
+  size_t numRunning = workers.size();
+  while (numRunning) {
+    vector<pollfd> fds;
+    vector<PdfWorker*> owners;
+    for (size_t i = 0; i < workers.size(); ++i) {
+      if (workers[i].resultFd < 0)
+        continue;
+      pollfd fd = {workers[i].resultFd, POLLIN, 0};
+      fds.push_back(fd);
+      owners.push_back(&workers[i]);
+    }
+    
+    if (poll(&fds[0], fds.size(), -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      throw runtime_error("Unable to wait for PDF worker processes");
+    }
+    
+    for (size_t i = 0; i < fds.size(); ++i) {
+      if (!fds[i].revents)
+        continue;
+      
+      PdfWorker& worker = *owners[i];
+      char chunk[4096];
+      ssize_t n = read(worker.resultFd, chunk, sizeof(chunk));
+      if (n < 0 && errno == EINTR)
+        continue;
+      
+      if (n > 0) {
+        worker.buffer.append(chunk, size_t(n));
+        
+        i32 index;
+        PdfResult result;
+        while (decodePdfResult(worker.buffer, index, result)) {
+          worker.current = -1;
+          reportPdf(batch, index, result);
+          sendPdfTask(batch, worker);
+        }
+        continue;
+      }
+      
+      // The worker has exited, whether or not it was asked to
+      if (worker.taskFd >= 0)
+        close(worker.taskFd);
+      close(worker.resultFd);
+      worker.taskFd = worker.resultFd = -1;
+      --numRunning;
+      
+      if (worker.current >= 0) {
+        PdfResult failed = PdfResult();
+        failed.message = "Worker process exited while rendering " +
+                         batch.inputs[worker.current].file;
+        reportPdf(batch, worker.current, failed);
+        worker.current = -1;
+        
+        // Idle workers were only waiting on this one's result
+        for (size_t j = 0; j < workers.size(); ++j) {
+          if (workers[j].current < 0)
+            sendPdfTask(batch, workers[j]);
+        }
+      }
+    }
+  }
+  
+  for (size_t i = 0; i < workers.size(); ++i)
+    waitpid(workers[i].pid, NULL, 0);
+  
+  signal(SIGPIPE, oldSigpipe);
+}
+
+/// The PDF commands only read MAT files and render them on the host, so they
+/// don't need an OpenCL context and can be spread over numJobs processes.
+void renderPdfs(int argc, char** argv) {
+  PdfBatch batch;
+  batch.next = 0;
+  batch.soFar = 0;
+  batch.paramsHash = parametersHash();
+  batch.stage = curvePdf ? "curve-pdf" : "flow-pdf";
+  
+  Manifest manifest(manifestPath());
+  batch.manifest = &manifest;
+  
+  for (i32 i = 0; i < argc; ++i) {
+    batch.inputs.push_back(parseInputPath(argv[i]));
+    if (batch.inputs[i].isMatFile() &&
+        !(resume && manifest.contains(batch.inputs[i].file, batch.stage,
+                                      batch.paramsHash)))
+      batch.pending.push_back(i);
+  }
+  i32 numWorkers = max(1, min(numJobs, i32(batch.pending.size())));
+  
+  cout << "Rendering " << argc << " input(s) to PDF with " << numWorkers
+       << " process(es)..." << endl;
+  tic();
+  
+  // Inputs that needn't be rendered are dealt with up front
+  for (i32 i = 0, p = 0; i < argc; ++i) {
+    const InputPath& input = batch.inputs[i];
+    if (p < i32(batch.pending.size()) && batch.pending[p] == i) {
+      ++p;
+      continue;
+    }
+    
+    cout << "Input " << ++batch.soFar << "/" << argc << ": "
+         << input.baseName << endl;
+    if (!input.isMatFile()) {
+      cout << "Didn't write PDF for " << input.name << "... not a MAT file"
+           << endl;
+    }
+    else
+      cout << "Output is up to date; skipping." << endl;
+  }
+  
+  if (numWorkers > 1)
+    renderPdfsInWorkers(batch, numWorkers);
+  else
+    renderPdfsSerially(batch);
+  
+  if (!batch.errors.empty()) {
+    stringstream ss;
+    ss << batch.errors.size() << " PDF(s) failed, first: "
+       << batch.errors[0];
+    die(ss.str());
+  }
+  
+  cout << "Done in " << toc()/1000000.f << " seconds." << endl;
+}
+
+void stageDone(const string& stage) {
+  f32 seconds = toc()/1000000.f;
+  metrics.observe(stage, seconds);
+  cout << "Done in " << seconds << " seconds." << endl;
+}
+
 void processImages(int& argc, char**& argv) {
   ProgramSettings settings = CLIP_DEFAULT_PROGRAM_SETTINGS;
   settings.memoryValueType = valueType;
   settings.bufferType = bufferType;
   
+  vector<cl::Platform> platforms;
+  vector<cl::Device> devices;
+  cl::Platform::get(&platforms);
+  
+  u64 deviceMemory = 0;
   if (deviceNum < 0) {
-    vector<cl::Platform> platforms;
-    vector<cl::Device> devices;
-    cl::Platform::get(&platforms);
     platforms[0].getDevices(CL_DEVICE_TYPE_DEFAULT, &devices);
     ClipInit(devices, settings);
+    if (!devices.empty())
+      deviceMemory = devices[0].getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
   }
-  else
+  else {
     ClipInit(platformNum, deviceNum, settings);
+    platforms[platformNum].getDevices(CL_DEVICE_TYPE_ALL, &devices);
+    deviceMemory = devices[deviceNum].getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+  }
+  
+  // The plan is an estimate, so images are only refused when asked to;
+  // otherwise exceeding the device's memory just draws a warning.
+  u64 deviceMemLimit = u64(memLimit*1024*1024);
   
   SetEnqueuesPerFinish(enqueuesPerFinish);
   
+  PipelineConfig pipeline;
+  pipeline.numOrientations = numOrientations;
+  pipeline.numCurvatures = numCurvatures;
+  pipeline.valueType = valueType;
+  pipeline.edgeInit = runEdgeInit || runEdgeRelax;
+  pipeline.edgeRelax = runEdgeRelax;
+  pipeline.lineInit = runLineInit || runLineRelax;
+  pipeline.lineRelax = runLineRelax;
+  pipeline.edgeSuppress = runEdgeSuppress;
+  pipeline.flowInit = runFlowInit || runFlowRelax;
+  pipeline.flowRelax = runFlowRelax;
+  
+  // Stage buffers are dropped as soon as no later stage reads them.
+  bool keepEdges = runEdgeSuppress;
+  bool keepLines = runEdgeSuppress;
+  bool keepImageAfterEdges = runLineInit || runLineRelax || runFlowInit ||
+                             runFlowRelax;
+  bool keepImageAfterLines = runFlowInit || runFlowRelax;
+  i32 numSkipped = 0;
+  
   LLInitOpParams edgeInitOpParams(Edges, numOrientations, numCurvatures,
                                   curveScale);
   shared_ptr<LLInitOps> edgeInitOps;
@@ -567,79 +1186,101 @@ void processImages(int& argc, char**& argv) {
   rlxFlowParams.minSupport = flowMinSupport;
   shared_ptr<RelaxFlowOp> rlxFlowOp;
   
+  Manifest manifest(manifestPath());
+  u64 paramsHash = parametersHash();
+  
+  vector<string> imageFiles;
+  vector<bool> upToDate;
+  for (i32 i = 0; i < argc; ++i) {
+    InputPath input = parseInputPath(argv[i]);
+    vector<string> stages = outputStages(input.isMatFile());
+    
+    bool done = resume &&
+                manifest.containsAll(input.file, stages, paramsHash);
+    
+    upToDate.push_back(done);
+    imageFiles.push_back(input.isMatFile() || done ? "" : input.file);
+  }
+  
+  // Decoding happens off the main thread so the next images are ready by the
+  // time the device finishes with the current one.
+  ImagePrefetcher prefetcher(imageFiles, numDecodeThreads,
+                             numDecodeThreads + 1);
+  
   i32 total = argc;
   i32 soFar = 0;
-  while (argc > 0) {
-    string imageFile(*argv);
-    size_t lastSlash = imageFile.find_last_of('/');
+  for (; argc > 0; --argc, ++argv) {
+    InputPath input = parseInputPath(*argv);
+    const string& imageFile = input.file;
+    const string& baseName = input.baseName;
     
-    string dirName = ".";
-    string imageName = imageFile;
-    if (lastSlash != string::npos) {
-      if (lastSlash >= imageFile.length() - 1)
-        die("Input name can't end in a slash");
-      
-      dirName = imageFile.substr(0, lastSlash);
-      imageName = imageFile.substr(lastSlash + 1);
-    }
-    
-    size_t lastDot = imageName.find_last_of('.');
-    if (lastDot == string::npos || lastDot >= imageName.length() - 1)
-      die("No filename extension found; unable to determine type");
+    ImageBuffer imageBuffer;
     
-    string baseName = imageName.substr(0, lastDot);
-    string extension = imageName.substr(lastDot + 1);
+    i32 index = soFar++;
+    cout << "Input " << index + 1 << "/" << total << ": " << baseName << endl;
     
-    ImageData imageData;
-    ImageBuffer imageBuffer;
+    if (upToDate[index]) {
+      cout << "Outputs are up to date; skipping." << endl;
+      if (argc > 1)
+        cout << endl;
+      continue;
+    }
     
-    bool isMatFile = extension == "mat";
+    bool isMatFile = input.isMatFile();
     if (!isMatFile) {
       try {
-        ReadImage(imageFile, imageData);
-        imageBuffer = ImageBuffer(imageData);
+        metrics.setGauge("decode_queue_depth", prefetcher.queued());
+        ImageDataPtr imageData = prefetcher.get(index);
+        
+        pipeline.width = imageData->width();
+        pipeline.height = imageData->height();
+        MemoryPlan plan = PlanMemory(pipeline);
+        metrics.setGauge("device_memory_planned_bytes",
+                         double(plan.devicePeak));
+        cout << "Planned peak memory: "
+             << FormatMegabytes(plan.devicePeak) << " device (during "
+             << plan.deviceStage << "), "
+             << FormatMegabytes(plan.hostPeak) << " host." << endl;
+        
+        u64 limit = deviceMemLimit ? deviceMemLimit : deviceMemory;
+        if (limit && plan.devicePeak > limit) {
+          cerr << (deviceMemLimit ? "Skipping " : "Warning: ") << input.name
+               << (deviceMemLimit ? ", which" : "")
+               << " may need more than the " << FormatMegabytes(limit)
+               << (deviceMemLimit ? " memory limit" : " of device memory");
+          if (valueType == Float32) {
+            pipeline.valueType = Float16;
+            cerr << " (" << FormatMegabytes(PlanMemory(pipeline).devicePeak)
+                 << " with --bit-depth 16)";
+            pipeline.valueType = valueType;
+          }
+          cerr << "." << endl;
+        }
+        
+        if (deviceMemLimit && plan.devicePeak > deviceMemLimit) {
+          ++numSkipped;
+          if (argc > 1)
+            cout << endl;
+          continue;
+        }
+        
+        imageBuffer = ImageBuffer(*imageData);
       }
       catch (const exception& err) {
         die(err.what());
       }
     }
     
+    metrics.beginImage();
+    metrics.addBytesRead(FileSize(imageFile));
+    
     CurveBuffersPtr edges, lines;
     CurveDataPtr edgesData, linesData;
     FlowBuffersPtr flow;
     FlowDataPtr flowData;
     
-    cout << "Input " << ++soFar << "/" << total << ": " << baseName << endl;
-    
     string outputBaseName = outputDir + "/" + baseName;
     
-    if (curvePdf || flowPdf) {
-      if (isMatFile) {
-        if (curvePdf) {
-          CurveDataPtr localCurveData = ReadMatlabArray<2>(imageFile);
-          if (!localCurveData.get())
-            die("Failed to read curve data");
-          cout << "Writing curve data to PDF... " << flush;
-          WriteLLColumnsToPDF(outputBaseName + ".pdf", *localCurveData,
-                              pdfThresh, pdfDarken);
-          cout << "done." << endl;
-        }
-        else {
-          FlowDataPtr localFlowData = ReadMatlabArray<3>(imageFile);
-          if (!localFlowData.get())
-            die("Failed to read flow data");
-          cout << "Writing flow data to PDF... " << flush;
-          WriteFlowToPDF(outputBaseName + ".pdf", *localFlowData,
-                         pdfThresh, pdfDarken);
-          cout << "done." << endl;
-        }
-      }
-      else {
-        cerr << "Didn't write PDF for " << imageName
-             << "... not a MAT file" << endl;
-      }
-    }
-    
     if (runEdgeInit || (runEdgeRelax && !isMatFile)) {
       if (!edgeInitOps.get()) {
         edgeInitOps = shared_ptr<LLInitOps>(new LLInitOps(edgeInitOpParams));
@@ -649,19 +1290,14 @@ void processImages(int& argc, char**& argv) {
       cout << "Calculating initial edge estimates..." << endl;
       tic();
       edges = edgeInitOps->apply(imageBuffer);
-      cout << "Done in " << toc()/1000000.f << " seconds." << endl;
+      stageDone("edge-init");
       
       edgesData = BufferArrayToDataArray(*edges);
       
-      string outputName = outputBaseName + "-edge-initial";
+      writeOutputs(outputBaseName + "-edge-initial", *edgesData);
+      manifest.record(imageFile, "edge-initial", paramsHash);
       
-      if (outputMatlab)
-        WriteMatlabArray(outputName + ".mat", *edgesData);
-      
-      if (outputPdf) {
-        WriteLLColumnsToPDF(outputName + ".pdf", *edgesData,
-                            pdfThresh, pdfDarken);
-      }
+      edgesData.reset();
     }
     if (runEdgeRelax) {
       if (isMatFile) {
@@ -681,20 +1317,20 @@ void processImages(int& argc, char**& argv) {
       cout << "Relaxing edges..." << endl;
       tic();
       edges = edgeRlxCurve->apply(*edges);
-      cout << "Done in " << toc()/1000000.f << " seconds." << endl;
+      stageDone("edge-relax");
       
       edgesData = BufferArrayToDataArray(*edges);
-      string outputName = outputBaseName + "-edge-relaxed";
+      writeOutputs(outputBaseName + "-edge-relaxed", *edgesData);
+      manifest.record(imageFile, "edge-relaxed", paramsHash);
       
-      if (outputMatlab)
-        WriteMatlabArray(outputName + ".mat", *edgesData);
-      
-      if (outputPdf) {
-        WriteLLColumnsToPDF(outputName + ".pdf", *edgesData,
-                            pdfThresh, pdfDarken);
-      }
+      edgesData.reset();
     }
     
+    if (!keepEdges)
+      edges.reset();
+    if (!keepImageAfterEdges)
+      imageBuffer = ImageBuffer();
+    
     if (runLineInit || (runLineRelax && !isMatFile)) {
       if (!lineInitOps.get()) {
         lineInitOps = shared_ptr<LLInitOps>(new LLInitOps(lineInitOpParams));
@@ -704,18 +1340,17 @@ void processImages(int& argc, char**& argv) {
       cout << "Calculating initial line estimates..." << endl;
       tic();
       lines = lineInitOps->apply(imageBuffer);
-      cout << "Done in " << toc()/1000000.f << " seconds." << endl;
+      stageDone("line-init");
       
-      linesData = BufferArrayToDataArray(*lines);
-      string outputName = outputBaseName + "-line-initial";
+      // Matches PlanMemory, which counts the image out of line-relax's peak.
+      if (!keepImageAfterLines)
+        imageBuffer = ImageBuffer();
       
-      if (outputMatlab)
-        WriteMatlabArray(outputName + ".mat", *linesData);
+      linesData = BufferArrayToDataArray(*lines);
+      writeOutputs(outputBaseName + "-line-initial", *linesData);
+      manifest.record(imageFile, "line-initial", paramsHash);
       
-      if (outputPdf) {
-        WriteLLColumnsToPDF(outputName + ".pdf", *linesData,
-                            pdfThresh, pdfDarken);
-      }
+      linesData.reset();
     }
     if (runLineRelax) {
       if (isMatFile) {
@@ -735,19 +1370,18 @@ void processImages(int& argc, char**& argv) {
       cout << "Relaxing lines..." << endl;
       tic();
       lines = lineRlxCurve->apply(*lines);
-      cout << "Done in " << toc()/1000000.f << " seconds." << endl;
+      stageDone("line-relax");
       
       linesData = BufferArrayToDataArray(*lines);
-      string outputName = outputBaseName + "-line-relaxed";
-      
-      if (outputMatlab)
-        WriteMatlabArray(outputName + ".mat", *linesData);
+      writeOutputs(outputBaseName + "-line-relaxed", *linesData);
+      manifest.record(imageFile, "line-relaxed", paramsHash);
       
-      if (outputPdf)
-        WriteLLColumnsToPDF(outputName + ".pdf", *linesData,
-                            pdfThresh, pdfDarken);
+      linesData.reset();
     }
     
+    if (!keepLines)
+      lines.reset();
+    
     if (runEdgeSuppress) {
       if (!edgeSuppressOps.get()) {
         edgeSuppressOps = shared_ptr<SuppressLineEdgesOp>
@@ -758,18 +1392,15 @@ void processImages(int& argc, char**& argv) {
       cout << "Suppressing edges around lines..." << endl;
       tic();
       edges = edgeSuppressOps->apply(*edges, *lines);
-      cout << "Done in " << toc()/1000000.f << " seconds." << endl;
+      stageDone("edge-suppress");
       
       edgesData = BufferArrayToDataArray(*edges);
-      string outputName = outputBaseName + "-edge-suppressed";
-      
-      if (outputMatlab)
-        WriteMatlabArray(outputName + ".mat", *edgesData);
+      writeOutputs(outputBaseName + "-edge-suppressed", *edgesData);
+      manifest.record(imageFile, "edge-suppressed", paramsHash);
       
-      if (outputPdf) {
-        WriteLLColumnsToPDF(outputName + ".pdf", *edgesData,
-                            pdfThresh, pdfDarken);
-      }
+      edges.reset();
+      lines.reset();
+      edgesData.reset();
     }
     
     if (runFlowInit || (runFlowRelax && !isMatFile)) {
@@ -800,16 +1431,15 @@ void processImages(int& argc, char**& argv) {
       cout << "Calculating initial flow estimates..." << endl;
       tic();
       flow = flowInitOps->apply(imageBuffer);
-      cout << "Done in " << toc()/1000000.f << " seconds." << endl;
+      stageDone("flow-init");
       
-      flowData = BufferArrayToDataArray(*flow);
-      string outputName = outputBaseName + "-flow-initial";
+      imageBuffer = ImageBuffer();
       
-      if (outputMatlab)
-        WriteMatlabArray(outputName + ".mat", *flowData);
+      flowData = BufferArrayToDataArray(*flow);
+      writeOutputs(outputBaseName + "-flow-initial", *flowData);
+      manifest.record(imageFile, "flow-initial", paramsHash);
       
-      if (outputPdf)
-        WriteFlowToPDF(outputName + ".pdf", *flowData, pdfThresh, pdfDarken);
+      flowData.reset();
     }
     if (runFlowRelax) {
       if (isMatFile) {
@@ -828,22 +1458,24 @@ void processImages(int& argc, char**& argv) {
       cout << "Relaxing flow..." << endl;
       tic();
       flow = rlxFlowOp->apply(*flow);
-      cout << "Done in " << toc()/1000000.f << " seconds." << endl;
+      stageDone("flow-relax");
       
       flowData = BufferArrayToDataArray(*flow);
-      string outputName = outputBaseName + "-flow-relaxed";
-      
-      if (outputMatlab)
-        WriteMatlabArray(outputName + ".mat", *flowData);
-      
-      if (outputPdf)
-        WriteFlowToPDF(outputName + ".pdf", *flowData, pdfThresh, pdfDarken);
+      writeOutputs(outputBaseName + "-flow-relaxed", *flowData);
+      manifest.record(imageFile, "flow-relaxed", paramsHash);
     }
     
+    metrics.endImage();
+    
     if (argc > 1)
       cout << endl;
-    
-    --argc; ++argv;
+  }
+  
+  if (numSkipped) {
+    stringstream ss;
+    ss << "Skipped " << numSkipped << " of " << total
+       << " input(s) that exceeded the memory limit";
+    die(ss.str());
   }
 }
 
@@ -854,10 +1486,22 @@ int main(int argc, char** argv) {
   if (!argc)
     die("No input files specified");
   
+  if (!metricsFile.empty())
+    metrics.start(metricsFile, metricsInterval);
+  
   try {
-    processImages(argc, argv);
+    if (curvePdf || flowPdf) {
+      renderPdfs(argc, argv);
+      if (deviceCommandsRequested())
+        cout << endl;
+    }
+    
+    if (deviceCommandsRequested())
+      processImages(argc, argv);
   }
   catch (const exception& err) {
     die(err.what());
   }
+  
+  metrics.stop();
 }
@@ -0,0 +1,440 @@
+#include "ingest.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace std::tr1;
+using namespace evp;
+
+namespace {
+
+// The same weights imload.m uses to reduce RGB to luminance.
+const f32 RedWeight = 0.212671f;
+const f32 GreenWeight = 0.715160f;
+const f32 BlueWeight = 0.072169f;
+
+class MappedFile {
+  const u8* data_;
+  size_t size_;
+
+  MappedFile(const MappedFile&);
+  MappedFile& operator=(const MappedFile&);
+
+ public:
+  explicit MappedFile(const string& file) : data_(NULL), size_(0) {
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw runtime_error("Unable to open " + file);
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+      close(fd);
+      throw runtime_error("Unable to read " + file);
+    }
+
+    size_ = size_t(info.st_size);
+    void* mapped = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapped == MAP_FAILED)
+      throw runtime_error("Unable to map " + file);
+
+    madvise(mapped, size_, MADV_SEQUENTIAL);
+    data_ = static_cast<const u8*>(mapped);
+  }
+
+  ~MappedFile() {
+    munmap(const_cast<u8*>(data_), size_);
+  }
+
+  const u8* data() const { return data_; }
+  size_t size() const { return size_; }
+};
+
+enum SampleType { UInt8, UInt16BE, UInt16LE, Float32LE };
+
+// The conversion loops below are written to be auto-vectorized: one pass per
+// row with no per-pixel branching. ImageData rows run bottom to top (see the
+// flip in evpload.m), so source rows are written in reverse order.
+
+inline f32 sampleAt(const u8* src, size_t i, SampleType type) {
+  switch (type) {
+    case UInt8:
+      return src[i];
+
+    case UInt16BE:
+      return f32(u16(src[2*i] << 8 | src[2*i + 1]));
+
+    case UInt16LE:
+      return f32(u16(src[2*i + 1] << 8 | src[2*i]));
+
+    default: {
+      f32 value;
+      memcpy(&value, src + 4*i, sizeof(value));
+      return value;
+    }
+  }
+}
+
+inline size_t sampleSize(SampleType type) {
+  return type == UInt8 ? 1 : type == Float32LE ? 4 : 2;
+}
+
+template<SampleType Type>
+void convertGrayRow(const u8* src, f32* dst, i32 width, f32 scale) {
+  for (i32 x = 0; x < width; ++x)
+    dst[x] = sampleAt(src, x, Type)*scale;
+}
+
+template<SampleType Type>
+void convertRgbRow(const u8* src, f32* dst, i32 width, f32 scale) {
+  const f32 r = RedWeight*scale, g = GreenWeight*scale, b = BlueWeight*scale;
+  for (i32 x = 0; x < width; ++x) {
+    dst[x] = r*sampleAt(src, 3*x, Type) +
+             g*sampleAt(src, 3*x + 1, Type) +
+             b*sampleAt(src, 3*x + 2, Type);
+  }
+}
+
+template<SampleType Type>
+void convertPixels(const u8* src, i32 width, i32 height, i32 channels,
+                   f32 scale, ImageData& data) {
+  data = ImageData(width, height);
+  f32* dst = data.data();
+  size_t rowBytes = size_t(width)*channels*sampleSize(Type);
+
+  for (i32 y = 0; y < height; ++y) {
+    const u8* srcRow = src + size_t(y)*rowBytes;
+    f32* dstRow = dst + size_t(height - 1 - y)*width;
+    if (channels == 1)
+      convertGrayRow<Type>(srcRow, dstRow, width, scale);
+    else
+      convertRgbRow<Type>(srcRow, dstRow, width, scale);
+  }
+}
+
+void convertPixels(SampleType type, const u8* src, i32 width, i32 height,
+                   i32 channels, f32 scale, ImageData& data) {
+  switch (type) {
+    case UInt8:
+      convertPixels<UInt8>(src, width, height, channels, scale, data);
+      break;
+
+    case UInt16BE:
+      convertPixels<UInt16BE>(src, width, height, channels, scale, data);
+      break;
+
+    case UInt16LE:
+      convertPixels<UInt16LE>(src, width, height, channels, scale, data);
+      break;
+
+    case Float32LE:
+      convertPixels<Float32LE>(src, width, height, channels, scale, data);
+      break;
+  }
+}
+
+bool hasExtension(const string& file, const char* ext) {
+  size_t lastDot = file.find_last_of('.');
+  if (lastDot == string::npos)
+    return false;
+
+  string fileExt = file.substr(lastDot + 1);
+  for (size_t i = 0; i < fileExt.length(); ++i)
+    fileExt[i] = char(tolower(fileExt[i]));
+
+  return fileExt == ext;
+}
+
+// Reads the next whitespace-delimited integer in a PNM header, skipping
+// comments.
+i32 readPnmInt(const MappedFile& file, size_t& pos) {
+  const u8* data = file.data();
+  size_t size = file.size();
+
+  for (;;) {
+    while (pos < size && isspace(data[pos]))
+      ++pos;
+    if (pos < size && data[pos] == '#') {
+      while (pos < size && data[pos] != '\n')
+        ++pos;
+    }
+    else
+      break;
+  }
+
+  i32 value = 0;
+  size_t start = pos;
+  while (pos < size && isdigit(data[pos]))
+    value = value*10 + (data[pos++] - '0');
+
+  if (pos == start)
+    throw runtime_error("Malformed PNM header");
+
+  return value;
+}
+
+void readPnm(const string& name, ImageData& data) {
+  MappedFile file(name);
+
+  if (file.size() < 2 || file.data()[0] != 'P' ||
+      (file.data()[1] != '5' && file.data()[1] != '6'))
+    throw runtime_error(name + " is not a binary PGM or PPM file");
+
+  i32 channels = file.data()[1] == '5' ? 1 : 3;
+  size_t pos = 2;
+  i32 width = readPnmInt(file, pos);
+  i32 height = readPnmInt(file, pos);
+  i32 maxVal = readPnmInt(file, pos);
+  ++pos; // Single whitespace character before the raster
+
+  if (width <= 0 || height <= 0 || maxVal <= 0 || maxVal > 65535)
+    throw runtime_error("Invalid PNM header in " + name);
+
+  SampleType type = maxVal < 256 ? UInt8 : UInt16BE;
+  size_t rasterSize = size_t(width)*height*channels*sampleSize(type);
+  if (pos + rasterSize > file.size())
+    throw runtime_error("File size does not agree with header in " + name);
+
+  convertPixels(type, file.data() + pos, width, height, channels,
+                1.f/maxVal, data);
+}
+
+string npyHeaderValue(const string& header, const string& key) {
+  size_t keyPos = header.find("'" + key + "'");
+  if (keyPos == string::npos)
+    return "";
+
+  size_t start = header.find(':', keyPos);
+  if (start == string::npos)
+    return "";
+
+  ++start;
+  while (start < header.length() && isspace(header[start]))
+    ++start;
+
+  size_t end = start;
+  if (start < header.length() && header[start] == '(')
+    end = header.find(')', start) + 1;
+  else if (start < header.length() && header[start] == '\'')
+    end = header.find('\'', start + 1) + 1;
+  else
+    end = header.find_first_of(",}", start);
+
+  return header.substr(start, end - start);
+}
+
+void readNpy(const string& name, ImageData& data) {
+  MappedFile file(name);
+  const u8* bytes = file.data();
+
+  if (file.size() < 10 || memcmp(bytes, "\x93NUMPY", 6) != 0)
+    throw runtime_error(name + " is not a .npy file");
+
+  size_t headerLen, headerStart;
+  if (bytes[6] == 1) {
+    headerLen = bytes[8] | bytes[9] << 8;
+    headerStart = 10;
+  }
+  else {
+    if (file.size() < 12)
+      throw runtime_error("Truncated .npy header in " + name);
+    headerLen = bytes[8] | bytes[9] << 8 | bytes[10] << 16 |
+                size_t(bytes[11]) << 24;
+    headerStart = 12;
+  }
+
+  if (headerStart + headerLen > file.size())
+    throw runtime_error("Truncated .npy header in " + name);
+
+  string header(reinterpret_cast<const char*>(bytes + headerStart),
+                headerLen);
+  string descr = npyHeaderValue(header, "descr");
+  string order = npyHeaderValue(header, "fortran_order");
+  string shape = npyHeaderValue(header, "shape");
+
+  if (order != "False")
+    throw runtime_error("Fortran-ordered .npy files aren't supported");
+
+  SampleType type;
+  f32 scale = 1.f;
+  if (descr == "'|u1'" || descr == "'<u1'") {
+    type = UInt8;
+    scale = 1.f/255;
+  }
+  else if (descr == "'<u2'") {
+    type = UInt16LE;
+    scale = 1.f/65535;
+  }
+  else if (descr == "'>u2'") {
+    type = UInt16BE;
+    scale = 1.f/65535;
+  }
+  else if (descr == "'<f4'")
+    type = Float32LE;
+  else
+    throw runtime_error("Unsupported .npy element type " + descr);
+
+  i32 dims[3] = {0, 0, 1};
+  i32 numDims = 0;
+  const char* s = shape.c_str();
+  while (*s && numDims < 4) {
+    if (isdigit(*s)) {
+      char* end;
+      i32 dim = i32(strtol(s, &end, 10));
+      if (numDims < 3)
+        dims[numDims] = dim;
+      ++numDims;
+      s = end;
+    }
+    else
+      ++s;
+  }
+
+  if (numDims < 2 || numDims > 3 || (numDims == 3 && dims[2] != 3))
+    throw runtime_error("Expected an (h, w) or (h, w, 3) array in " + name);
+  if (dims[0] <= 0 || dims[1] <= 0)
+    throw runtime_error("Empty array in " + name);
+
+  i32 height = dims[0], width = dims[1], channels = dims[2];
+  size_t rasterStart = headerStart + headerLen;
+  size_t rasterSize = size_t(width)*height*channels*sampleSize(type);
+  if (rasterStart + rasterSize > file.size())
+    throw runtime_error("File size does not agree with header in " + name);
+
+  convertPixels(type, bytes + rasterStart, width, height, channels, scale,
+                data);
+}
+
+} // namespace
+
+void ReadInputImage(const string& file, ImageData& data) {
+  if (hasExtension(file, "pgm") || hasExtension(file, "ppm"))
+    readPnm(file, data);
+  else if (hasExtension(file, "npy"))
+    readNpy(file, data);
+  else
+    ReadImage(file, data);
+}
+
+ImagePrefetcher::ImagePrefetcher(const vector<string>& files, i32 numThreads,
+                                 i32 lookahead)
+  : files_(files), slots_(files.size()), lookahead_(max(lookahead, 1)),
+    next_(0), consumed_(0), stopping_(false), workers_(NULL) {
+  workers_ = new ThreadGroup(numThreads, &worker, this);
+}
+
+ImagePrefetcher::~ImagePrefetcher() {
+  {
+    ScopedLock lock(lock_);
+    stopping_ = true;
+    space_.broadcast();
+  }
+  delete workers_;
+}
+
+void* ImagePrefetcher::worker(void* arg) {
+  static_cast<ImagePrefetcher*>(arg)->run();
+  return NULL;
+}
+
+void ImagePrefetcher::run() {
+  for (;;) {
+    i32 index;
+    {
+      ScopedLock lock(lock_);
+      while (!stopping_ && next_ < i32(slots_.size()) &&
+             next_ >= consumed_ + lookahead_)
+        space_.wait(lock_);
+
+      if (stopping_ || next_ >= i32(slots_.size()))
+        return;
+
+      index = next_++;
+      slots_[index].state = Slot::Decoding;
+    }
+
+    decode(index);
+  }
+}
+
+void ImagePrefetcher::decode(i32 index) {
+  ImageDataPtr data;
+  string error;
+
+  if (!files_[index].empty()) {
+    try {
+      data = ImageDataPtr(new ImageData());
+      ReadInputImage(files_[index], *data);
+    }
+    catch (const exception& err) {
+      data.reset();
+      error = err.what();
+    }
+  }
+
+  ScopedLock lock(lock_);
+  if (index < consumed_)
+    data.reset(); // Skipped while it was being decoded
+  slots_[index].data = data;
+  slots_[index].error = error;
+  slots_[index].state = Slot::Ready;
+  ready_.broadcast();
+}
+
+ImageDataPtr ImagePrefetcher::get(i32 index) {
+  bool decodeHere = false;
+  {
+    ScopedLock lock(lock_);
+    // Images before index that were never requested (e.g. MAT inputs, or
+    // inputs skipped by --resume) are given up on so that their lookahead
+    // slots are freed for the images still to come.
+    for (i32 i = consumed_; i < index; ++i)
+      slots_[i].data.reset();
+    next_ = max(next_, index);
+    consumed_ = max(consumed_, index);
+    space_.broadcast();
+
+    // Nobody has picked this image up yet (e.g. no workers could be
+    // started), so decode it on the calling thread rather than waiting.
+    if (slots_[index].state == Slot::Waiting && next_ == index) {
+      ++next_;
+      slots_[index].state = Slot::Decoding;
+      decodeHere = true;
+    }
+  }
+
+  if (decodeHere)
+    decode(index);
+
+  ScopedLock lock(lock_);
+  while (slots_[index].state != Slot::Ready)
+    ready_.wait(lock_);
+
+  Slot& slot = slots_[index];
+  ImageDataPtr data = slot.data;
+  string error = slot.error;
+  slot.data.reset();
+
+  consumed_ = max(consumed_, index + 1);
+  space_.broadcast();
+
+  if (!error.empty())
+    throw runtime_error(error);
+
+  return data;
+}
+
+i32 ImagePrefetcher::queued() const {
+  ScopedLock lock(lock_);
+  return next_ - consumed_;
+}
@@ -0,0 +1,66 @@
+#ifndef EVP_TOOLS_INGEST_HPP
+#define EVP_TOOLS_INGEST_HPP
+
+#include <string>
+#include <vector>
+
+#include <evp.hpp>
+
+#include "threads.hpp"
+
+typedef std::tr1::shared_ptr<evp::ImageData> ImageDataPtr;
+
+/// Reads an image into data as luminance in [0, 1]. Binary PGM/PPM and .npy
+/// files are memory mapped and converted directly; everything else goes
+/// through evp::ReadImage.
+void ReadInputImage(const std::string& file, evp::ImageData& data);
+
+/// Decodes a list of images ahead of their use on a pool of background
+/// threads. Images must be requested in increasing order with get(), but
+/// need not all be requested: asking for an image gives up on any earlier
+/// ones. At most lookahead decoded images are held at any one time. Empty
+/// file names are skipped and yield a null image.
+class ImagePrefetcher {
+  struct Slot {
+    enum State { Waiting, Decoding, Ready };
+
+    State state;
+    ImageDataPtr data;
+    std::string error;
+
+    Slot() : state(Waiting) {}
+  };
+
+  std::vector<std::string> files_;
+  std::vector<Slot> slots_;
+  i32 lookahead_;
+  i32 next_;
+  i32 consumed_;
+  bool stopping_;
+
+  mutable Mutex lock_;
+  Condition ready_;
+  Condition space_;
+  ThreadGroup* workers_;
+
+  ImagePrefetcher(const ImagePrefetcher&);
+  ImagePrefetcher& operator=(const ImagePrefetcher&);
+
+  static void* worker(void* arg);
+  void run();
+  void decode(i32 index);
+
+ public:
+  ImagePrefetcher(const std::vector<std::string>& files, i32 numThreads,
+                  i32 lookahead);
+  ~ImagePrefetcher();
+
+  /// Returns image index, blocking until it is decoded. Throws
+  /// std::runtime_error if decoding failed.
+  ImageDataPtr get(i32 index);
+
+  /// The number of images decoded (or being decoded) but not yet retrieved.
+  i32 queued() const;
+};
+
+#endif
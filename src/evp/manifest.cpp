@@ -0,0 +1,116 @@
+#include "manifest.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+Manifest::Manifest(const string& path) : path_(path), fd_(-1) {
+  ifstream in(path.c_str());
+  string line;
+  while (getline(in, line)) {
+    if (!line.empty())
+      entries_.insert(line);
+  }
+
+  fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd_ < 0)
+    throw runtime_error("Unable to open manifest " + path);
+}
+
+Manifest::~Manifest() {
+  close(fd_);
+}
+
+string Manifest::entry(const string& input, const string& stage, u64 hash) {
+  stringstream ss;
+  ss << hex << hash << '\t' << stage << '\t' << input;
+  return ss.str();
+}
+
+bool Manifest::contains(const string& input, const string& stage,
+                        u64 hash) const {
+  ScopedLock lock(lock_);
+  return entries_.count(entry(input, stage, hash)) > 0;
+}
+
+bool Manifest::containsAll(const string& input, const vector<string>& stages,
+                           u64 hash) const {
+  for (size_t i = 0; i < stages.size(); ++i) {
+    if (!contains(input, stages[i], hash))
+      return false;
+  }
+  return true;
+}
+
+void Manifest::record(const string& input, const string& stage, u64 hash) {
+  string line = entry(input, stage, hash);
+
+  ScopedLock lock(lock_);
+  if (!entries_.insert(line).second)
+    return;
+
+  // A single O_APPEND write keeps lines from concurrent processes whole.
+  line += '\n';
+  if (write(fd_, line.data(), line.size()) != ssize_t(line.size()) ||
+      fsync(fd_) != 0)
+    throw runtime_error("Unable to write to manifest " + path_);
+}
+
+u64 HashString(const string& str) {
+  u64 hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < str.length(); ++i) {
+    hash ^= u8(str[i]);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+string PartialOutputName(const string& name) {
+  size_t lastSlash = name.find_last_of('/');
+  size_t start = lastSlash == string::npos ? 0 : lastSlash + 1;
+  return name.substr(0, start) + "." + name.substr(start) + ".partial";
+}
+
+namespace {
+
+void syncPath(const string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0 || fsync(fd) != 0) {
+    string error = strerror(errno);
+    if (fd >= 0)
+      close(fd);
+    throw runtime_error("Unable to sync " + path + " (" + error + ")");
+  }
+  close(fd);
+}
+
+string directoryOf(const string& path) {
+  size_t lastSlash = path.find_last_of('/');
+  if (lastSlash == string::npos)
+    return ".";
+  return lastSlash == 0 ? "/" : path.substr(0, lastSlash);
+}
+
+} // namespace
+
+void CommitOutput(const string& partialName, const string& name) {
+  // The data has to be on disk before the rename, and the rename before the
+  // caller records the output in the manifest. Otherwise a crash could leave
+  // a manifest entry for an empty or truncated file.
+  syncPath(partialName);
+
+  if (rename(partialName.c_str(), name.c_str()) != 0) {
+    throw runtime_error("Unable to move " + partialName + " to " + name +
+                        " (" + strerror(errno) + ")");
+  }
+
+  syncPath(directoryOf(name));
+}
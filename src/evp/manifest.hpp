@@ -0,0 +1,53 @@
+#ifndef EVP_TOOLS_MANIFEST_HPP
+#define EVP_TOOLS_MANIFEST_HPP
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include <evp.hpp>
+
+#include "threads.hpp"
+
+/// An append-only journal of completed outputs, one line per (parameter
+/// hash, stage, input) entry. Each entry is synced to disk as soon as it is
+/// recorded, so the manifest survives the process being killed, and several
+/// processes can safely share one manifest.
+class Manifest {
+  std::string path_;
+  std::set<std::string> entries_;
+  int fd_;
+  mutable Mutex lock_;
+
+  Manifest(const Manifest&);
+  Manifest& operator=(const Manifest&);
+
+  static std::string entry(const std::string& input, const std::string& stage,
+                           u64 hash);
+
+ public:
+  explicit Manifest(const std::string& path);
+  ~Manifest();
+
+  bool contains(const std::string& input, const std::string& stage,
+                u64 hash) const;
+  bool containsAll(const std::string& input,
+                   const std::vector<std::string>& stages, u64 hash) const;
+  void record(const std::string& input, const std::string& stage, u64 hash);
+};
+
+/// A 64-bit FNV-1a hash, used to fingerprint the parameters that produced an
+/// output.
+u64 HashString(const std::string& str);
+
+/// The name to write an output to before it is moved into place with
+/// CommitOutput(). It is hidden and doesn't share the output's extension, so
+/// tools watching the output directory never see a partial file.
+std::string PartialOutputName(const std::string& name);
+
+/// Atomically replaces name with partialName, syncing the file's data and
+/// then the directory entry to disk. Call it before recording the output in
+/// a Manifest.
+void CommitOutput(const std::string& partialName, const std::string& name);
+
+#endif
@@ -0,0 +1,111 @@
+#include "memplan.hpp"
+
+#include <iomanip>
+#include <sstream>
+
+using namespace std;
+using namespace evp;
+
+namespace {
+
+// Scratch space each kind of operator needs on top of its input and output,
+// in units of its output stack. These are deliberately on the high side: an
+// overestimate only costs a warning, an underestimate costs a failed batch.
+const u64 InitScratchStacks = 1;
+const u64 RelaxScratchStacks = 2;
+const u64 SuppressScratchStacks = 1;
+
+class PeakTracker {
+  u64 live_;
+  u64 peak_;
+  string stage_;
+
+ public:
+  PeakTracker() : live_(0), peak_(0) {}
+
+  void alloc(u64 bytes) { live_ += bytes; }
+  void free(u64 bytes) { live_ -= bytes; }
+
+  void run(const string& stage, u64 scratch) {
+    if (live_ + scratch > peak_) {
+      peak_ = live_ + scratch;
+      stage_ = stage;
+    }
+  }
+
+  u64 peak() const { return peak_; }
+  const string& stage() const { return stage_; }
+};
+
+} // namespace
+
+MemoryPlan PlanMemory(const PipelineConfig& config) {
+  u64 pixels = u64(config.width)*config.height;
+  u64 plane = pixels*(config.valueType == Float16 ? 2 : 4);
+  u64 curveStack = plane*config.numOrientations*config.numCurvatures;
+  u64 flowStack = curveStack*config.numCurvatures;
+
+  bool needEdges = config.edgeInit || config.edgeRelax || config.edgeSuppress;
+  bool needLines = config.lineInit || config.lineRelax || config.edgeSuppress;
+  bool needFlow = config.flowInit || config.flowRelax;
+
+  PeakTracker device;
+  device.alloc(plane); // The input image
+
+  if (needEdges) {
+    device.run("edge-init", curveStack*(1 + InitScratchStacks));
+    device.alloc(curveStack);
+    if (config.edgeRelax)
+      device.run("edge-relax", curveStack*RelaxScratchStacks);
+    if (!config.edgeSuppress)
+      device.free(curveStack);
+  }
+
+  if (!needLines && !needFlow)
+    device.free(plane);
+
+  if (needLines) {
+    device.run("line-init", curveStack*(1 + InitScratchStacks));
+    device.alloc(curveStack);
+    if (!needFlow)
+      device.free(plane);
+    if (config.lineRelax)
+      device.run("line-relax", curveStack*RelaxScratchStacks);
+    if (!config.edgeSuppress)
+      device.free(curveStack);
+  }
+
+  if (config.edgeSuppress) {
+    device.run("edge-suppress", curveStack*SuppressScratchStacks);
+    device.free(2*curveStack);
+  }
+
+  if (needFlow) {
+    device.run("flow-init", flowStack*(1 + InitScratchStacks));
+    device.free(plane);
+    device.alloc(flowStack);
+    if (config.flowRelax)
+      device.run("flow-relax", flowStack*RelaxScratchStacks);
+  }
+
+  // On the host the decoded image is kept alongside one full precision copy
+  // of whichever stage's output is being written.
+  u64 hostImage = pixels*sizeof(f32);
+  u64 hostStack = 0;
+  if (needEdges || needLines)
+    hostStack = curveStack/plane*pixels*sizeof(f32);
+  if (needFlow)
+    hostStack = flowStack/plane*pixels*sizeof(f32);
+
+  MemoryPlan plan;
+  plan.devicePeak = device.peak();
+  plan.deviceStage = device.stage();
+  plan.hostPeak = hostImage + hostStack;
+  return plan;
+}
+
+string FormatMegabytes(u64 bytes) {
+  stringstream ss;
+  ss << fixed << setprecision(1) << bytes/(1024.*1024.) << " MB";
+  return ss.str();
+}
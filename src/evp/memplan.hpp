@@ -0,0 +1,34 @@
+#ifndef EVP_TOOLS_MEMPLAN_HPP
+#define EVP_TOOLS_MEMPLAN_HPP
+
+#include <string>
+
+#include <evp.hpp>
+
+/// The commands requested for an image, along with the parameters that
+/// determine how large their buffers are.
+struct PipelineConfig {
+  i32 width, height;
+  i32 numOrientations, numCurvatures;
+  evp::ValueType valueType;
+
+  bool edgeInit, edgeRelax;
+  bool lineInit, lineRelax;
+  bool edgeSuppress;
+  bool flowInit, flowRelax;
+};
+
+/// Estimated peak memory use for running a pipeline on one image, assuming
+/// each stage's buffers are released as soon as no later stage needs them.
+struct MemoryPlan {
+  u64 devicePeak;
+  u64 hostPeak;
+  std::string deviceStage;
+};
+
+MemoryPlan PlanMemory(const PipelineConfig& config);
+
+/// Formats a byte count in megabytes for reporting.
+std::string FormatMegabytes(u64 bytes);
+
+#endif
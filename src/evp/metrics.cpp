@@ -0,0 +1,253 @@
+#include "metrics.hpp"
+
+#include <fstream>
+#include <sstream>
+
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "manifest.hpp"
+
+using namespace std;
+
+namespace {
+
+// Upper bounds, in seconds, of the stage latency histogram buckets.
+const double Buckets[] = {0.1, 0.5, 1, 2, 5, 10, 30, 60, 120, 300, 600};
+const size_t NumBuckets = sizeof(Buckets)/sizeof(double);
+
+double now() {
+  timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec/1e6;
+}
+
+} // namespace
+
+Metrics::Histogram::Histogram() : counts(NumBuckets + 1), sum(0), count(0) {}
+
+Metrics::Metrics()
+  : interval_(0), startTime_(now()), imageStartTime_(0),
+    imagesProcessed_(0), bytesRead_(0), bytesWritten_(0), stopping_(false),
+    writer_(NULL) {}
+
+Metrics::~Metrics() {
+  stop();
+}
+
+void Metrics::start(const string& path, double interval) {
+  {
+    ScopedLock lock(lock_);
+    path_ = path;
+    interval_ = interval;
+    stopping_ = false;
+  }
+  writer_ = new ThreadGroup(1, &writer, this);
+}
+
+void Metrics::stop() {
+  if (!writer_)
+    return;
+
+  {
+    ScopedLock lock(lock_);
+    stopping_ = true;
+    wake_.signal();
+  }
+
+  delete writer_;
+  writer_ = NULL;
+  write();
+}
+
+void* Metrics::writer(void* arg) {
+  static_cast<Metrics*>(arg)->run();
+  return NULL;
+}
+
+void Metrics::run() {
+  for (;;) {
+    {
+      ScopedLock lock(lock_);
+      if (!stopping_)
+        wake_.waitFor(lock_, interval_);
+      if (stopping_)
+        return;
+    }
+
+    write();
+  }
+}
+
+void Metrics::beginImage() {
+  ScopedLock lock(lock_);
+  imageStartTime_ = now();
+}
+
+void Metrics::endImage() {
+  ScopedLock lock(lock_);
+  ++imagesProcessed_;
+  imageStartTime_ = 0;
+}
+
+void Metrics::observe(const string& stage, double seconds) {
+  ScopedLock lock(lock_);
+  Histogram& histogram = stages_[stage];
+
+  size_t bucket = 0;
+  while (bucket < NumBuckets && seconds > Buckets[bucket])
+    ++bucket;
+
+  ++histogram.counts[bucket];
+  histogram.sum += seconds;
+  ++histogram.count;
+}
+
+void Metrics::addBytesRead(u64 bytes) {
+  ScopedLock lock(lock_);
+  bytesRead_ += bytes;
+}
+
+void Metrics::addBytesWritten(u64 bytes) {
+  ScopedLock lock(lock_);
+  bytesWritten_ += bytes;
+}
+
+void Metrics::setGauge(const string& name, double value) {
+  ScopedLock lock(lock_);
+  gauges_[name] = value;
+}
+
+void Metrics::write() {
+  string path, snapshot;
+  {
+    ScopedLock lock(lock_);
+    if (path_.empty())
+      return;
+
+    path = path_;
+    bool isJson = path.length() >= 5 &&
+                  path.compare(path.length() - 5, 5, ".json") == 0;
+    snapshot = isJson ? json() : prometheus();
+  }
+
+  // Failing to write metrics shouldn't take down a batch run, so errors are
+  // ignored and the next snapshot simply tries again.
+  string partial = PartialOutputName(path);
+  {
+    ofstream out(partial.c_str());
+    out << snapshot;
+    if (!out)
+      return;
+  }
+
+  try {
+    CommitOutput(partial, path);
+  }
+  catch (const exception&) {}
+}
+
+string Metrics::prometheus() const {
+  double t = now(), uptime = t - startTime_;
+  stringstream ss;
+
+  ss << "# TYPE evp_uptime_seconds gauge\n"
+     << "evp_uptime_seconds " << uptime << "\n"
+     << "# TYPE evp_images_processed_total counter\n"
+     << "evp_images_processed_total " << imagesProcessed_ << "\n"
+     << "# TYPE evp_images_per_second gauge\n"
+     << "evp_images_per_second " << imagesProcessed_/uptime << "\n"
+     << "# TYPE evp_current_image_seconds gauge\n"
+     << "evp_current_image_seconds "
+     << (imageStartTime_ ? t - imageStartTime_ : 0) << "\n"
+     << "# TYPE evp_bytes_read_total counter\n"
+     << "evp_bytes_read_total " << bytesRead_ << "\n"
+     << "# TYPE evp_bytes_written_total counter\n"
+     << "evp_bytes_written_total " << bytesWritten_ << "\n";
+
+  map<string, double>::const_iterator gauge;
+  for (gauge = gauges_.begin(); gauge != gauges_.end(); ++gauge) {
+    ss << "# TYPE evp_" << gauge->first << " gauge\n"
+       << "evp_" << gauge->first << " " << gauge->second << "\n";
+  }
+
+  if (!stages_.empty())
+    ss << "# TYPE evp_stage_seconds histogram\n";
+
+  map<string, Histogram>::const_iterator stage;
+  for (stage = stages_.begin(); stage != stages_.end(); ++stage) {
+    const Histogram& h = stage->second;
+    string label = "stage=\"" + stage->first + "\"";
+
+    u64 cumulative = 0;
+    for (size_t i = 0; i <= NumBuckets; ++i) {
+      cumulative += h.counts[i];
+      ss << "evp_stage_seconds_bucket{" << label << ",le=\"";
+      if (i < NumBuckets)
+        ss << Buckets[i];
+      else
+        ss << "+Inf";
+      ss << "\"} " << cumulative << "\n";
+    }
+
+    ss << "evp_stage_seconds_sum{" << label << "} " << h.sum << "\n"
+       << "evp_stage_seconds_count{" << label << "} " << h.count << "\n";
+  }
+
+  return ss.str();
+}
+
+string Metrics::json() const {
+  double t = now(), uptime = t - startTime_;
+  stringstream ss;
+
+  ss << "{\n"
+     << "  \"uptime_seconds\": " << uptime << ",\n"
+     << "  \"images_processed\": " << imagesProcessed_ << ",\n"
+     << "  \"images_per_second\": " << imagesProcessed_/uptime << ",\n"
+     << "  \"current_image_seconds\": "
+     << (imageStartTime_ ? t - imageStartTime_ : 0) << ",\n"
+     << "  \"bytes_read\": " << bytesRead_ << ",\n"
+     << "  \"bytes_written\": " << bytesWritten_ << ",\n"
+     << "  \"gauges\": {";
+
+  map<string, double>::const_iterator gauge;
+  for (gauge = gauges_.begin(); gauge != gauges_.end(); ++gauge) {
+    ss << (gauge == gauges_.begin() ? "\n" : ",\n")
+       << "    \"" << gauge->first << "\": " << gauge->second;
+  }
+
+  ss << (gauges_.empty() ? "" : "\n  ") << "},\n"
+     << "  \"stages\": {";
+
+  map<string, Histogram>::const_iterator stage;
+  for (stage = stages_.begin(); stage != stages_.end(); ++stage) {
+    const Histogram& h = stage->second;
+    ss << (stage == stages_.begin() ? "\n" : ",\n")
+       << "    \"" << stage->first << "\": {\"count\": " << h.count
+       << ", \"sum\": " << h.sum << ", \"buckets\": [";
+
+    for (size_t i = 0; i <= NumBuckets; ++i) {
+      ss << (i ? ", " : "") << "[";
+      if (i < NumBuckets)
+        ss << Buckets[i];
+      else
+        ss << "null";
+      ss << ", " << h.counts[i] << "]";
+    }
+
+    ss << "]}";
+  }
+
+  ss << (stages_.empty() ? "" : "\n  ") << "}\n"
+     << "}\n";
+
+  return ss.str();
+}
+
+u64 FileSize(const string& path) {
+  struct stat info;
+  if (stat(path.c_str(), &info) != 0)
+    return 0;
+  return u64(info.st_size);
+}
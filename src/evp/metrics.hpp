@@ -0,0 +1,70 @@
+#ifndef EVP_TOOLS_METRICS_HPP
+#define EVP_TOOLS_METRICS_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <evp.hpp>
+
+#include "threads.hpp"
+
+/// Live counters for a batch run. Once started, a background thread
+/// periodically rewrites a snapshot to a file, as JSON if the file name ends
+/// in .json and in the Prometheus text format otherwise. Recording is cheap
+/// and safe from any thread, and does nothing visible until start() is
+/// called.
+class Metrics {
+  struct Histogram {
+    std::vector<u64> counts;
+    double sum;
+    u64 count;
+
+    Histogram();
+  };
+
+  std::string path_;
+  double interval_;
+  double startTime_;
+  double imageStartTime_;
+  u64 imagesProcessed_;
+  u64 bytesRead_;
+  u64 bytesWritten_;
+  std::map<std::string, Histogram> stages_;
+  std::map<std::string, double> gauges_;
+
+  bool stopping_;
+  mutable Mutex lock_;
+  Condition wake_;
+  ThreadGroup* writer_;
+
+  Metrics(const Metrics&);
+  Metrics& operator=(const Metrics&);
+
+  static void* writer(void* arg);
+  void run();
+  std::string prometheus() const;
+  std::string json() const;
+
+ public:
+  Metrics();
+  ~Metrics();
+
+  void start(const std::string& path, double interval);
+  void stop();
+
+  void beginImage();
+  void endImage();
+  void observe(const std::string& stage, double seconds);
+  void addBytesRead(u64 bytes);
+  void addBytesWritten(u64 bytes);
+  void setGauge(const std::string& name, double value);
+
+  /// Writes a snapshot immediately.
+  void write();
+};
+
+/// The size of a file in bytes, or 0 if it can't be read.
+u64 FileSize(const std::string& path);
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef EVP_TOOLS_THREADS_HPP
+#define EVP_TOOLS_THREADS_HPP
+
+#include <vector>
+
+#include <pthread.h>
+#include <sys/time.h>
+
+class Mutex {
+  pthread_mutex_t mutex_;
+
+  Mutex(const Mutex&);
+  Mutex& operator=(const Mutex&);
+
+  friend class Condition;
+
+ public:
+  Mutex() { pthread_mutex_init(&mutex_, NULL); }
+  ~Mutex() { pthread_mutex_destroy(&mutex_); }
+
+  void lock() { pthread_mutex_lock(&mutex_); }
+  void unlock() { pthread_mutex_unlock(&mutex_); }
+};
+
+class ScopedLock {
+  Mutex& mutex_;
+
+  ScopedLock(const ScopedLock&);
+  ScopedLock& operator=(const ScopedLock&);
+
+ public:
+  explicit ScopedLock(Mutex& mutex) : mutex_(mutex) { mutex_.lock(); }
+  ~ScopedLock() { mutex_.unlock(); }
+};
+
+class Condition {
+  pthread_cond_t cond_;
+
+  Condition(const Condition&);
+  Condition& operator=(const Condition&);
+
+ public:
+  Condition() { pthread_cond_init(&cond_, NULL); }
+  ~Condition() { pthread_cond_destroy(&cond_); }
+
+  void wait(Mutex& mutex) { pthread_cond_wait(&cond_, &mutex.mutex_); }
+
+  /// Waits at most the given number of seconds; returns false on timeout.
+  bool waitFor(Mutex& mutex, double seconds) {
+    timeval now;
+    gettimeofday(&now, NULL);
+    double deadline = now.tv_sec + now.tv_usec/1e6 + seconds;
+
+    timespec until;
+    until.tv_sec = time_t(deadline);
+    until.tv_nsec = long((deadline - until.tv_sec)*1e9);
+    return pthread_cond_timedwait(&cond_, &mutex.mutex_, &until) == 0;
+  }
+
+  void signal() { pthread_cond_signal(&cond_); }
+  void broadcast() { pthread_cond_broadcast(&cond_); }
+};
+
+/// A fixed set of threads all running the same entry point. The threads are
+/// started on construction and joined by join() or on destruction. Threads
+/// that fail to start are dropped, so callers should check size().
+class ThreadGroup {
+  std::vector<pthread_t> threads_;
+
+  ThreadGroup(const ThreadGroup&);
+  ThreadGroup& operator=(const ThreadGroup&);
+
+ public:
+  ThreadGroup(int numThreads, void* (*entry)(void*), void* arg) {
+    for (int i = 0; i < numThreads; ++i) {
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, entry, arg) == 0)
+        threads_.push_back(thread);
+    }
+  }
+
+  ~ThreadGroup() { join(); }
+
+  int size() const { return int(threads_.size()); }
+
+  void join() {
+    for (size_t i = 0; i < threads_.size(); ++i)
+      pthread_join(threads_[i], NULL);
+    threads_.clear();
+  }
+};
+
+#endif
@@ -0,0 +1,48 @@
+function [errs pass] = evpcompare(output, reference, tol)
+
+if ~exist('tol', 'var')
+  tol = 1e-4;
+end
+
+if exist(output, 'dir')
+  % Every reference must have a matching output, so go by the references
+  files = dir(fullfile(reference, '*.mat'));
+  if isempty(files)
+    error('No reference outputs found in %s.', reference);
+  end
+  names = {files.name};
+  outputs = fullfile(output, names);
+  references = fullfile(reference, names);
+else
+  [folder name ext] = fileparts(output); %#ok<ASGLU>
+  names = {[name ext]};
+  outputs = {output};
+  references = {reference};
+end
+
+errs = zeros(1, numel(outputs));
+for i = 1:numel(outputs)
+  if ~exist(outputs{i}, 'file') || ~exist(references{i}, 'file')
+    errs(i) = inf;
+  else
+    errs(i) = relerr(evpload(outputs{i}), evpload(references{i}));
+  end
+
+  if errs(i) <= tol
+    status = 'ok';
+  else
+    status = 'FAILED';
+  end
+
+  fprintf('%-40s %10.3g  %s\n', names{i}, errs(i), status);
+end
+
+pass = all(errs <= tol);
+
+function err = relerr(out, ref)
+
+if ~isequal(size(out), size(ref))
+  err = inf;
+else
+  err = max(abs(out(:) - ref(:)))/max(max(abs(ref(:))), eps);
+end
@@ -0,0 +1,174 @@
+#include <cmath>
+#include <cstdio>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#ifndef EVP_NO_PNG
+#include <png.h>
+#endif
+
+#include <evp.hpp>
+
+#include "ingest.hpp"
+#include "test.hpp"
+
+using namespace std;
+using namespace evp;
+
+namespace {
+
+// A small test pattern with distinct values in every row and column, so any
+// flip or transposition shows up.
+u8 patternAt(i32 x, i32 y, i32 c) {
+  return u8((x*37 + y*91 + c*53) % 256);
+}
+
+const i32 Width = 7, Height = 5;
+
+string writePnm(const string& name, i32 channels) {
+  string path = tempPath(name);
+  FILE* file = fopen(path.c_str(), "wb");
+  fprintf(file, "P%d\n# test pattern\n%d %d\n255\n", channels == 1 ? 5 : 6,
+          Width, Height);
+  for (i32 y = 0; y < Height; ++y) {
+    for (i32 x = 0; x < Width; ++x) {
+      for (i32 c = 0; c < channels; ++c)
+        fputc(patternAt(x, y, c), file);
+    }
+  }
+  fclose(file);
+  return path;
+}
+
+string writeNpy(const string& name, const string& shape, size_t bytes) {
+  string header = "{'descr': '|u1', 'fortran_order': False, 'shape': " +
+                  shape + ", }";
+  while ((10 + header.length() + 1) % 64)
+    header += ' ';
+  header += '\n';
+
+  string path = tempPath(name);
+  FILE* file = fopen(path.c_str(), "wb");
+  fwrite("\x93NUMPY\x01\x00", 1, 8, file);
+  fputc(int(header.length() & 0xff), file);
+  fputc(int(header.length() >> 8), file);
+  fwrite(header.data(), 1, header.length(), file);
+  for (size_t i = 0; i < bytes; ++i)
+    fputc(int(i % 256), file);
+  fclose(file);
+  return path;
+}
+
+#ifndef EVP_NO_PNG
+string writePng(const string& name, i32 channels) {
+  string path = tempPath(name);
+  FILE* file = fopen(path.c_str(), "wb");
+
+  png_structp png =
+    png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_infop info = png_create_info_struct(png);
+  png_init_io(png, file);
+  png_set_IHDR(png, info, Width, Height, 8,
+               channels == 1 ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_RGB,
+               PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+               PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png, info);
+
+  vector<png_byte> row(Width*channels);
+  for (i32 y = 0; y < Height; ++y) {
+    for (i32 x = 0; x < Width; ++x) {
+      for (i32 c = 0; c < channels; ++c)
+        row[x*channels + c] = patternAt(x, y, c);
+    }
+    png_write_row(png, &row[0]);
+  }
+
+  png_write_end(png, NULL);
+  png_destroy_write_struct(&png, &info);
+  fclose(file);
+  return path;
+}
+
+f32 maxDifference(const ImageData& a, const ImageData& b) {
+  if (a.width() != b.width() || a.height() != b.height())
+    return HUGE_VALF;
+
+  f32 diff = 0;
+  for (i32 i = 0; i < a.width()*a.height(); ++i)
+    diff = max(diff, fabsf(a.data()[i] - b.data()[i]));
+  return diff;
+}
+
+// The fast PNM path must produce exactly what ReadImage produces for the
+// same pixels, including row order, scaling and luminance weights.
+void testPnmMatchesReadImage() {
+  for (i32 channels = 1; channels <= 3; channels += 2) {
+    ImageData fast, reference;
+    ReadInputImage(writePnm(channels == 1 ? "a.pgm" : "a.ppm", channels),
+                   fast);
+    ReadImage(writePng(channels == 1 ? "a-gray.png" : "a-rgb.png", channels),
+              reference);
+
+    stringstream what;
+    what << "PNM fast path matches ReadImage (" << channels << " channels)";
+    check(maxDifference(fast, reference) < 1e-5f, what.str());
+  }
+}
+#endif
+
+void testNpy() {
+  ImageData data;
+  ReadInputImage(writeNpy("a.npy", "(5, 7)", Width*Height), data);
+  check(data.width() == Width && data.height() == Height, ".npy dimensions");
+
+  bool threw = false;
+  try {
+    ReadInputImage(writeNpy("empty.npy", "(0, 7)", 0), data);
+  }
+  catch (const exception&) {
+    threw = true;
+  }
+  check(threw, ".npy with a zero dimension is rejected");
+}
+
+// Mirrors processImages: empty names stand for inputs that are never
+// requested (MAT files), and only the others are passed to get().
+void testPrefetcherSkipsInputs(const vector<string>& files, i32 numThreads,
+                               const string& what) {
+  ImagePrefetcher prefetcher(files, numThreads, numThreads + 1);
+  for (i32 i = 0; i < i32(files.size()); ++i) {
+    if (files[i].empty())
+      continue;
+
+    ImageDataPtr data = prefetcher.get(i);
+    check(data.get() && data->width() == Width, what);
+  }
+}
+
+void testPrefetcher() {
+  string pgm = writePnm("b.pgm", 1);
+
+  for (i32 numThreads = 0; numThreads <= 3; ++numThreads) {
+    vector<string> leading(3, "");
+    leading.push_back(pgm);
+    testPrefetcherSkipsInputs(leading, numThreads,
+                              "prefetcher with leading skipped inputs");
+
+    vector<string> mixed;
+    for (i32 i = 0; i < 12; ++i)
+      mixed.push_back(i % 4 == 1 || i == 11 ? pgm : "");
+    testPrefetcherSkipsInputs(mixed, numThreads,
+                              "prefetcher with mixed inputs");
+  }
+}
+
+} // namespace
+
+void RunIngestTests() {
+  testNpy();
+  testPrefetcher();
+#ifndef EVP_NO_PNG
+  testPnmMatchesReadImage();
+#endif
+}
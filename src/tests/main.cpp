@@ -0,0 +1,64 @@
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include <unistd.h>
+
+#include "test.hpp"
+
+using namespace std;
+
+namespace {
+
+int numFailures = 0;
+string tempDir;
+vector<string> tempFiles;
+
+} // namespace
+
+void check(bool cond, const string& what) {
+  if (!cond) {
+    cerr << "FAILED: " << what << endl;
+    ++numFailures;
+  }
+}
+
+string tempPath(const string& name) {
+  string path = tempDir + "/" + name;
+  tempFiles.push_back(path);
+  return path;
+}
+
+int main() {
+  // Anything that deadlocks fails the run rather than hanging it.
+  alarm(60);
+
+  char dirTemplate[] = "/tmp/evp-tests.XXXXXX";
+  if (!mkdtemp(dirTemplate)) {
+    cerr << "Unable to create a temporary directory." << endl;
+    return 1;
+  }
+  tempDir = dirTemplate;
+
+  try {
+    RunIngestTests();
+    RunManifestTests();
+  }
+  catch (const exception& err) {
+    cerr << "FAILED: " << err.what() << endl;
+    ++numFailures;
+  }
+
+  for (size_t i = 0; i < tempFiles.size(); ++i)
+    unlink(tempFiles[i].c_str());
+  rmdir(tempDir.c_str());
+
+  if (numFailures) {
+    cerr << numFailures << " check(s) failed." << endl;
+    return 1;
+  }
+
+  cout << "All checks passed." << endl;
+  return 0;
+}
@@ -0,0 +1,107 @@
+#include <cstdio>
+#include <fstream>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include <evp.hpp>
+
+#include "ingest.hpp"
+#include "manifest.hpp"
+#include "test.hpp"
+
+using namespace std;
+using namespace evp;
+
+namespace {
+
+bool exists(const string& path) {
+  struct stat info;
+  return stat(path.c_str(), &info) == 0;
+}
+
+void testCommitOutput() {
+  string name = tempPath("out.mat");
+  string partial = PartialOutputName(name);
+  tempPath(".out.mat.partial");
+
+  {
+    ofstream out(partial.c_str());
+    out << "data";
+  }
+  CommitOutput(partial, name);
+
+  check(!exists(partial) && exists(name), "CommitOutput moves the output");
+  ifstream in(name.c_str());
+  string contents;
+  in >> contents;
+  check(contents == "data", "CommitOutput keeps the contents");
+}
+
+// A run that was interrupted after finishing the first few inputs is
+// restarted with --resume: the finished inputs are skipped without being
+// fetched, exactly as processImages does it.
+void testResumedRun() {
+  string manifestName = tempPath("evp-manifest.txt");
+  u64 hash = HashString("parameters");
+
+  vector<string> stages;
+  stages.push_back("edge-initial");
+  stages.push_back("edge-relaxed");
+
+  string image = tempPath("c.pgm");
+  {
+    FILE* file = fopen(image.c_str(), "wb");
+    fprintf(file, "P5\n2 2\n255\n");
+    fwrite("\x01\x02\x03\x04", 1, 4, file);
+    fclose(file);
+  }
+
+  vector<string> inputs;
+  for (i32 i = 0; i < 8; ++i) {
+    char name[32];
+    sprintf(name, "input-%d.pgm", i);
+    inputs.push_back(name);
+  }
+
+  {
+    Manifest manifest(manifestName);
+    for (i32 i = 0; i < 5; ++i) {
+      for (size_t j = 0; j < stages.size(); ++j)
+        manifest.record(inputs[i], stages[j], hash);
+    }
+    // Input 5 was interrupted between stages
+    manifest.record(inputs[5], stages[0], hash);
+  }
+
+  for (i32 numThreads = 0; numThreads <= 2; ++numThreads) {
+    Manifest manifest(manifestName);
+
+    vector<string> files;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      bool done = manifest.containsAll(inputs[i], stages, hash);
+      files.push_back(done ? "" : image);
+    }
+
+    check(files[4].empty() && !files[5].empty(),
+          "resume skips only fully finished inputs");
+    check(!manifest.containsAll(inputs[0], stages, HashString("other")),
+          "resume reruns inputs made with other parameters");
+
+    ImagePrefetcher prefetcher(files, numThreads, numThreads + 1);
+    for (i32 i = 0; i < i32(files.size()); ++i) {
+      if (files[i].empty())
+        continue;
+
+      ImageDataPtr data = prefetcher.get(i);
+      check(data.get() && data->width() == 2, "resumed run fetches inputs");
+    }
+  }
+}
+
+} // namespace
+
+void RunManifestTests() {
+  testCommitOutput();
+  testResumedRun();
+}
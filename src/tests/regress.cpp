@@ -0,0 +1,618 @@
+// Regression and accuracy driver for the device commands. It runs the evp
+// program on small synthetic images in every storage mode, checks the
+// reduced precision and global memory modes against the default mode with
+// per-mode tolerances, and checks the default mode against stored reference
+// outputs. Each mode runs in its own evp process, so the commands go through
+// exactly the code path a batch run uses, and OpenCL is only ever
+// initialized once per process.
+//
+//   evp-regress -d 2 --refs ../src/tests/refs --write-refs
+//   evp-regress -d 2 --refs ../src/tests/refs --timings timings.tsv
+
+#include <cerrno>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifndef EVP_NO_MATIO
+#include <matio.h>
+#endif
+
+#include <evp.hpp>
+
+using namespace std;
+
+namespace {
+
+/// A storage mode, and how far its outputs may stray from the default
+/// mode's, measured as in evpcompare.m.
+struct Mode {
+  const char* name;
+  const char* bitDepth;
+  const char* bufferType;
+  double tolerance;
+};
+
+// The first mode is the baseline the others are compared against, and the
+// one stored as the reference outputs. Half precision keeps about three
+// significant digits, which relaxation compounds over its iterations.
+const Mode Modes[] = {
+  {"f32-texture", "32", "Texture", 0},
+  {"f32-global", "32", "Global", 1e-4},
+  {"f16-texture", "16", "Texture", 2e-2},
+  {"f16-global", "16", "Global", 2e-2}
+};
+const i32 NumModes = sizeof(Modes)/sizeof(Mode);
+
+// Reference outputs may come from a different CPU device or OpenCL
+// implementation than the one being tested.
+const double ReferenceTolerance = 1e-4;
+
+// Relaxing outputs read back from MAT files must match relaxing them
+// straight after the initial stage.
+const double RoundTripTolerance = 1e-5;
+
+const char* ImageNames[] = {"shapes", "grating"};
+const i32 NumImages = sizeof(ImageNames)/sizeof(char*);
+
+const char* Stages[] = {
+  "edge-initial", "edge-relaxed", "line-initial", "line-relaxed",
+  "edge-suppressed", "flow-initial", "flow-relaxed"
+};
+const i32 NumStages = sizeof(Stages)/sizeof(char*);
+
+const i32 Width = 64, Height = 48;
+
+string evpPath;
+vector<string> deviceArgs;
+string refsDir;
+bool writeRefs = false;
+string timingsFile;
+string workDir;
+bool keepWorkDir = false;
+
+i32 numFailures = 0;
+
+void die(const string& msg) {
+  cerr << "Error: " << msg << "." << endl;
+  exit(1);
+}
+
+void fail(const string& what) {
+  cerr << "FAILED: " << what << endl;
+  ++numFailures;
+}
+
+// Test images ////////////////////////////////////////////////////////////////
+
+// A fixed linear congruential generator, so the noise is the same on every
+// platform.
+class Noise {
+  u32 state_;
+
+ public:
+  Noise() : state_(12345) {}
+
+  double next() {
+    state_ = state_*1103515245u + 12345u;
+    return ((state_ >> 16) & 0x7fff)/32767.;
+  }
+};
+
+// A disc and a step give curved and straight edges, and a thin bar gives a
+// line for edge-suppress to work on.
+double shapesAt(i32 x, i32 y) {
+  double dx = x - 20.5, dy = y - 24.5;
+  double value = dx*dx + dy*dy < 12*12 ? 0.8 : 0.2;
+  if (x >= 44)
+    value += 0.3;
+  if (y >= 10 && y < 38 && (x == 52 || x == 53))
+    value = 0.05;
+  return value;
+}
+
+// A grating whose orientation turns across the image, giving flow-init a
+// smoothly varying orientation field.
+double gratingAt(i32 x, i32 y) {
+  double theta = 0.6*x/Width;
+  double u = x*cos(theta) + y*sin(theta);
+  return 0.5 + 0.4*sin(2*M_PI*u/6);
+}
+
+string writeImage(const string& name) {
+  string path = workDir + "/" + name + ".pgm";
+  FILE* file = fopen(path.c_str(), "wb");
+  if (!file)
+    die("Unable to write " + path);
+
+  Noise noise;
+  fprintf(file, "P5\n%d %d\n255\n", Width, Height);
+  for (i32 y = 0; y < Height; ++y) {
+    for (i32 x = 0; x < Width; ++x) {
+      double value = name == "shapes" ? shapesAt(x, y) : gratingAt(x, y);
+      value += 0.04*(noise.next() - 0.5);
+      fputc(int(min(max(value, 0.), 1.)*255 + 0.5), file);
+    }
+  }
+
+  fclose(file);
+  return path;
+}
+
+// Running evp ////////////////////////////////////////////////////////////////
+
+void printFile(const string& path) {
+  ifstream in(path.c_str());
+  cerr << in.rdbuf();
+}
+
+/// Runs evp with args, sending its output to logFile. Returns whether it
+/// exited successfully; if not, its output is shown.
+bool runEvp(const vector<string>& args, const string& logFile) {
+  vector<string> all(1, evpPath);
+  all.insert(all.end(), deviceArgs.begin(), deviceArgs.end());
+  all.insert(all.end(), args.begin(), args.end());
+
+  vector<char*> argv;
+  for (size_t i = 0; i < all.size(); ++i)
+    argv.push_back(const_cast<char*>(all[i].c_str()));
+  argv.push_back(NULL);
+
+  cout.flush();
+  cerr.flush();
+
+  pid_t pid = fork();
+  if (pid < 0)
+    die("Unable to start " + evpPath);
+
+  if (pid == 0) {
+    int fd = open(logFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+      dup2(fd, 1);
+      dup2(fd, 2);
+      close(fd);
+    }
+    execv(argv[0], &argv[0]);
+    _exit(127);
+  }
+
+  int status;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR)
+      die("Unable to wait for " + evpPath);
+  }
+
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+    return true;
+
+  stringstream what;
+  what << evpPath;
+  for (size_t i = 1; i < all.size(); ++i)
+    what << ' ' << all[i];
+  fail(what.str());
+  printFile(logFile);
+  return false;
+}
+
+string makeDir(const string& path) {
+  if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+    die("Unable to create " + path);
+  return path;
+}
+
+int removeEntry(const char* path, const struct stat*, int, struct FTW*) {
+  return remove(path);
+}
+
+// Timing /////////////////////////////////////////////////////////////////////
+
+typedef map<string, double> StageTimes;
+
+/// Reads the total time spent in each stage from a metrics file written in
+/// the Prometheus format.
+StageTimes readStageTimes(const string& metricsFile) {
+  const string prefix = "evp_stage_seconds_sum{stage=\"";
+
+  StageTimes times;
+  ifstream in(metricsFile.c_str());
+  string line;
+  while (getline(in, line)) {
+    if (line.compare(0, prefix.length(), prefix) != 0)
+      continue;
+
+    size_t end = line.find('"', prefix.length());
+    if (end == string::npos)
+      continue;
+
+    stringstream ss(line.substr(line.find(' ', end) + 1));
+    ss >> times[line.substr(prefix.length(), end - prefix.length())];
+  }
+
+  return times;
+}
+
+void reportTimes(const vector<StageTimes>& times) {
+  cout << endl << "Stage times (seconds, all images):" << endl;
+  cout << "  " << string(16, ' ');
+  for (i32 m = 0; m < NumModes; ++m) {
+    cout.width(13);
+    cout << Modes[m].name;
+  }
+  cout << endl;
+
+  StageTimes::const_iterator stage;
+  for (stage = times[0].begin(); stage != times[0].end(); ++stage) {
+    cout << "  " << stage->first << string(16 - stage->first.length(), ' ');
+    for (i32 m = 0; m < NumModes; ++m) {
+      cout.width(13);
+      StageTimes::const_iterator t = times[m].find(stage->first);
+      if (t == times[m].end())
+        cout << "-";
+      else
+        cout << t->second;
+    }
+    cout << endl;
+  }
+
+  if (timingsFile.empty())
+    return;
+
+  ofstream out(timingsFile.c_str());
+  out << "mode\tstage\tseconds\n";
+  for (i32 m = 0; m < NumModes; ++m) {
+    for (stage = times[m].begin(); stage != times[m].end(); ++stage) {
+      out << Modes[m].name << '\t' << stage->first << '\t' << stage->second
+          << '\n';
+    }
+  }
+  if (!out)
+    fail("Writing timings to " + timingsFile);
+}
+
+// Comparing outputs //////////////////////////////////////////////////////////
+
+struct Array {
+  vector<size_t> dims;
+  vector<double> values;
+};
+
+#ifndef EVP_NO_MATIO
+/// Reads the first variable of a MAT file, which is where evp puts its
+/// output.
+Array readArray(const string& file) {
+  mat_t* mat = Mat_Open(file.c_str(), MAT_ACC_RDONLY);
+  if (!mat)
+    throw runtime_error("Unable to open " + file);
+
+  matvar_t* var = Mat_VarReadNext(mat);
+  Mat_Close(mat);
+  if (!var)
+    throw runtime_error("No variable in " + file);
+
+  Array array;
+  array.dims.assign(var->dims, var->dims + var->rank);
+
+  size_t count = 1;
+  for (int i = 0; i < var->rank; ++i)
+    count *= var->dims[i];
+
+  bool known = !var->isComplex &&
+               (var->class_type == MAT_C_SINGLE ||
+                var->class_type == MAT_C_DOUBLE);
+  if (known) {
+    array.values.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+      if (var->class_type == MAT_C_SINGLE)
+        array.values[i] = static_cast<const f32*>(var->data)[i];
+      else
+        array.values[i] = static_cast<const double*>(var->data)[i];
+    }
+  }
+
+  Mat_VarFree(var);
+  if (!known)
+    throw runtime_error(file + " doesn't hold a real floating point array");
+
+  return array;
+}
+#else
+Array readArray(const string& file) {
+  throw runtime_error("Unable to read " + file + " without MAT file support");
+}
+#endif
+
+/// The largest difference relative to the largest reference value, as
+/// evpcompare.m measures it. Differing shapes or any NaN count as infinite.
+double relativeError(const Array& out, const Array& ref) {
+  if (out.dims != ref.dims)
+    return HUGE_VAL;
+
+  double maxDiff = 0, maxRef = 0;
+  for (size_t i = 0; i < ref.values.size(); ++i) {
+    double diff = fabs(out.values[i] - ref.values[i]);
+    if (diff != diff)
+      return HUGE_VAL;
+    maxDiff = max(maxDiff, diff);
+    maxRef = max(maxRef, fabs(ref.values[i]));
+  }
+
+  return maxDiff/max(maxRef, DBL_EPSILON);
+}
+
+void compare(const string& output, const string& reference, double tolerance,
+             const string& what) {
+  double err;
+  try {
+    err = relativeError(readArray(output), readArray(reference));
+  }
+  catch (const exception& e) {
+    fail(what + ": " + e.what());
+    return;
+  }
+
+  cout << "  ";
+  cout.width(44);
+  cout << left << what << right;
+  cout.width(11);
+  cout << err << (err <= tolerance ? "  ok" : "  FAILED") << endl;
+
+  if (!(err <= tolerance)) {
+    stringstream ss;
+    ss << what << " differs by " << err << " (tolerance " << tolerance
+       << ")";
+    fail(ss.str());
+  }
+}
+
+void copyFile(const string& from, const string& to) {
+  ifstream in(from.c_str(), ios::binary);
+  ofstream out(to.c_str(), ios::binary);
+  out << in.rdbuf();
+  if (!in || !out)
+    fail("Copying " + from + " to " + to);
+}
+
+bool isPdf(const string& file) {
+  ifstream in(file.c_str(), ios::binary);
+  char magic[5] = {0};
+  in.read(magic, 4);
+  return string(magic) == "%PDF";
+}
+
+// The suite //////////////////////////////////////////////////////////////////
+
+string outputName(const string& dir, i32 image, const string& stage,
+                  const string& ext = ".mat") {
+  return dir + "/" + ImageNames[image] + "-" + stage + ext;
+}
+
+void runSuite() {
+  vector<string> images;
+  for (i32 i = 0; i < NumImages; ++i)
+    images.push_back(writeImage(ImageNames[i]));
+
+  // Every device command, in every mode
+  vector<StageTimes> times(NumModes);
+  vector<bool> ran(NumModes);
+  for (i32 m = 0; m < NumModes; ++m) {
+    cout << "Running all device commands (" << Modes[m].name << ")..."
+         << endl;
+    string dir = makeDir(workDir + "/" + Modes[m].name);
+
+    vector<string> args;
+    const char* commands[] = {
+      "edge-init", "edge-relax", "line-init", "line-relax", "edge-suppress",
+      "flow-init", "flow-relax", "-b", Modes[m].bitDepth, "--buf-type",
+      Modes[m].bufferType, "-o", dir.c_str(), "--metrics",
+    };
+    args.assign(commands, commands + sizeof(commands)/sizeof(char*));
+    args.push_back(dir + "/metrics.prom");
+    args.insert(args.end(), images.begin(), images.end());
+
+    ran[m] = runEvp(args, dir + "/log.txt");
+    if (ran[m])
+      times[m] = readStageTimes(dir + "/metrics.prom");
+  }
+
+  if (!ran[0]) {
+    fail("The baseline mode didn't run; nothing to compare against");
+    return;
+  }
+
+  string baseDir = workDir + "/" + Modes[0].name;
+
+  cout << endl << "Comparing modes against " << Modes[0].name << ":"
+       << endl;
+  for (i32 m = 1; m < NumModes; ++m) {
+    if (!ran[m])
+      continue;
+    for (i32 i = 0; i < NumImages; ++i) {
+      for (i32 s = 0; s < NumStages; ++s) {
+        string dir = workDir + "/" + Modes[m].name;
+        compare(outputName(dir, i, Stages[s]),
+                outputName(baseDir, i, Stages[s]), Modes[m].tolerance,
+                string(Modes[m].name) + " " + ImageNames[i] + "-" +
+                Stages[s]);
+      }
+    }
+  }
+
+  // The relaxation commands on MAT file inputs
+  cout << endl << "Relaxing initial outputs read back from MAT files:"
+       << endl;
+  string matDir = makeDir(workDir + "/from-mat");
+  const char* relaxations[][2] = {
+    {"edge-relax", "edge"}, {"line-relax", "line"}, {"flow-relax", "flow"}
+  };
+  for (i32 r = 0; r < 3; ++r) {
+    string kind = relaxations[r][1];
+    vector<string> args;
+    args.push_back(relaxations[r][0]);
+    args.push_back("-o");
+    args.push_back(matDir);
+    for (i32 i = 0; i < NumImages; ++i)
+      args.push_back(outputName(baseDir, i, kind + "-initial"));
+
+    if (!runEvp(args, matDir + "/log-" + kind + ".txt"))
+      continue;
+
+    for (i32 i = 0; i < NumImages; ++i) {
+      compare(outputName(matDir, i, kind + "-initial-" + kind + "-relaxed"),
+              outputName(baseDir, i, kind + "-relaxed"), RoundTripTolerance,
+              string(ImageNames[i]) + "-" + kind + "-relaxed from MAT");
+    }
+  }
+
+  // The PDF commands, on two worker processes
+  cout << endl << "Rendering PDFs:" << endl;
+  string pdfDir = makeDir(workDir + "/pdf");
+  const char* renders[][2] = {{"curve-pdf", "edge-relaxed"},
+                              {"flow-pdf", "flow-relaxed"}};
+  for (i32 r = 0; r < 2; ++r) {
+    vector<string> args;
+    args.push_back(renders[r][0]);
+    args.push_back("-j");
+    args.push_back("2");
+    args.push_back("-o");
+    args.push_back(pdfDir);
+    for (i32 i = 0; i < NumImages; ++i)
+      args.push_back(outputName(baseDir, i, renders[r][1]));
+
+    if (!runEvp(args, pdfDir + "/log-" + renders[r][0] + ".txt"))
+      continue;
+
+    for (i32 i = 0; i < NumImages; ++i) {
+      string pdf = outputName(pdfDir, i, renders[r][1], ".pdf");
+      bool ok = isPdf(pdf);
+      cout << "  " << pdf.substr(pdfDir.length() + 1)
+           << (ok ? "  ok" : "  FAILED") << endl;
+      if (!ok)
+        fail(string(renders[r][0]) + " didn't write " + pdf);
+    }
+  }
+
+  // The baseline against the stored references
+  if (writeRefs) {
+    makeDir(refsDir);
+    for (i32 i = 0; i < NumImages; ++i) {
+      for (i32 s = 0; s < NumStages; ++s) {
+        copyFile(outputName(baseDir, i, Stages[s]),
+                 outputName(refsDir, i, Stages[s]));
+      }
+    }
+    cout << endl << "Wrote reference outputs to " << refsDir << "." << endl;
+  }
+  else if (!refsDir.empty()) {
+    cout << endl << "Comparing " << Modes[0].name << " against "
+         << refsDir << ":" << endl;
+    for (i32 i = 0; i < NumImages; ++i) {
+      for (i32 s = 0; s < NumStages; ++s) {
+        compare(outputName(baseDir, i, Stages[s]),
+                outputName(refsDir, i, Stages[s]), ReferenceTolerance,
+                string(ImageNames[i]) + "-" + Stages[s] + " vs reference");
+      }
+    }
+  }
+  else {
+    cout << endl << "No --refs given; only comparing modes with each other."
+         << endl;
+  }
+
+  reportTimes(times);
+}
+
+void usage() {
+  cout << "Usage: evp-regress [options]\n"
+       << "  --evp <path>        The evp program (defaults to the one next "
+          "to this one).\n"
+       << "  -p/--platform <id>  Select OpenCL platform <id> for evp.\n"
+       << "  -d/--device <id>    Select OpenCL device <id> for evp.\n"
+       << "  --refs <dir>        Compare against reference outputs in "
+          "<dir>.\n"
+       << "  --write-refs        Store this run's outputs in the --refs "
+          "directory.\n"
+       << "  --timings <file>    Write stage times to <file>.\n"
+       << "  -o/--output-dir <dir>  Work in (and keep) <dir>.\n";
+  cout.flush();
+  exit(0);
+}
+
+string argument(int& i, int argc, char** argv) {
+  if (++i >= argc)
+    die("Argument not supplied to final option");
+  return argv[i];
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  string self = argv[0];
+  size_t lastSlash = self.find_last_of('/');
+  evpPath = (lastSlash == string::npos ? "." : self.substr(0, lastSlash)) +
+            "/evp";
+
+  for (int i = 1; i < argc; ++i) {
+    string opt = argv[i];
+    if (opt == "-h" || opt == "--help")
+      usage();
+    else if (opt == "--evp")
+      evpPath = argument(i, argc, argv);
+    else if (opt == "-p" || opt == "--platform" || opt == "-d" ||
+             opt == "--device") {
+      deviceArgs.push_back(opt);
+      deviceArgs.push_back(argument(i, argc, argv));
+    }
+    else if (opt == "--refs")
+      refsDir = argument(i, argc, argv);
+    else if (opt == "--write-refs")
+      writeRefs = true;
+    else if (opt == "--timings")
+      timingsFile = argument(i, argc, argv);
+    else if (opt == "-o" || opt == "--output-dir") {
+      workDir = makeDir(argument(i, argc, argv));
+      keepWorkDir = true;
+    }
+    else
+      die("Unrecognized option " + opt);
+  }
+
+  if (writeRefs && refsDir.empty())
+    die("--write-refs needs --refs to say where to write them");
+
+#ifdef EVP_NO_MATIO
+  die("evp-regress needs MAT file support to compare outputs");
+#else
+  if (workDir.empty()) {
+    char dirTemplate[] = "/tmp/evp-regress.XXXXXX";
+    if (!mkdtemp(dirTemplate))
+      die("Unable to create a temporary directory");
+    workDir = dirTemplate;
+  }
+
+  runSuite();
+
+  if (!keepWorkDir)
+    nftw(workDir.c_str(), &removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+
+  if (numFailures) {
+    cerr << numFailures << " check(s) failed." << endl;
+    return 1;
+  }
+
+  cout << "All checks passed." << endl;
+  return 0;
+#endif
+}
@@ -0,0 +1,15 @@
+#ifndef EVP_TOOLS_TEST_HPP
+#define EVP_TOOLS_TEST_HPP
+
+#include <string>
+
+/// Records a failure (and keeps going) if cond is false.
+void check(bool cond, const std::string& what);
+
+/// A path for a scratch file; everything created there is removed at exit.
+std::string tempPath(const std::string& name);
+
+void RunIngestTests();
+void RunManifestTests();
+
+#endif